@@ -6,12 +6,57 @@
 #include <type_traits>
 #include <string>
 #include <memory>
+#include <new>
 #include <vector>
+#include <list>
+#include <algorithm>
 #include <functional>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <tuple>
+#include <utility>
+#include <initializer_list>
+#include <future>
+#include <chrono>
+#include <exception>
+
+#if __cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L)
+#define LUA_WRAPPER_HAS_CPP17
+#include <string_view>
+#include <optional>
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#define LUA_WRAPPER_HAS_COROUTINES
+#include <coroutine>
+#endif
+#endif
+
+#if defined(__has_include) && (__cplusplus >= 202002L || (defined(_MSVC_LANG) && _MSVC_LANG >= 202002L))
+#if __has_include(<span>)
+#define LUA_WRAPPER_HAS_SPAN
+#include <span>
+#endif
+#endif
 
 /*
 	OPTIONS:
 
+	Unless LUA_WRAPPER_NO_DEFAULTS is defined,
+	LUA_WRAPPER_IMPLEMENTATION_LUAJIT and
+	LUA_WRAPPER_TABLE_RETURN are selected when
+	no other option of their group is, and
+	LUA_WRAPPER_STATELESS_STRINGS and
+	LUA_WRAPPER_SMART_FUNCTIONS are enabled.
+
 	IMPLEMENTATION OPTIONS (required):
 
 	- LUA_WRAPPER_IMPLEMENTATION_LUAJIT
@@ -36,6 +81,15 @@
 	as it wants. All return values will be
 	returned as an std::vector.
 
+	NUMBER CONVERSION OPTIONS (optional):
+
+	- LUA_WRAPPER_NUMBER_STRICT
+	Numbers are only stored as integers when
+	Lua itself says they are (Lua 5.3), every
+	other number keeps its exact lua_Number
+	value. By default LuaJIT numbers holding
+	an integral value are stored as integers.
+
 	MISC OPTIONS (optional):
 
 	- LUA_WRAPPER_STATELESS_STRINGS
@@ -48,19 +102,112 @@
 	as functions and for Lua functions to
 	be obtained as an std::function. This
 	option may incur performance penalites.
+
+	- LUA_WRAPPER_REF_POOL
+	Stores registry-backed locals in a
+	dedicated, pre-sized reference table with
+	a C++-side free list instead of going
+	through luaL_ref. The initial capacity is
+	set by LUA_WRAPPER_REF_POOL_SIZE and the
+	number of released references that are
+	cleared at once by LUA_WRAPPER_REF_POOL_BATCH.
+
+	- LUA_WRAPPER_SHARED_REFS
+	Copies of a registry-backed local share
+	the same reference slot, which is kept
+	alive by a per-state reference count.
+
+	- LUA_WRAPPER_CHUNK_CACHE
+	Compiled chunks are cached per state,
+	keyed by a hash of their source, so
+	load_string and do_string only parse a
+	given source once. The cache can be
+	saved as bytecode and loaded by another
+	process built against the same Lua.
+	It keeps the LUA_WRAPPER_CHUNK_CACHE_SIZE
+	most recently used chunks by default,
+	see set_chunk_cache_capacity.
+
+	- LUA_WRAPPER_STATE_POOL
+	Enables state_pool, a set of states each
+	pinned to a worker thread that run
+	submitted jobs with work stealing.
+	Requires linking against the platform's
+	thread library.
+
+	- LUA_WRAPPER_MAPPED_FILES
+	Enables mapped_file and
+	state::load_file_mmap. Includes
+	<windows.h> or the POSIX mmap headers,
+	defining no macros of its own, so
+	WIN32_LEAN_AND_MEAN and NOMINMAX are left
+	to the includer.
+
+	- LUA_WRAPPER_INSTRUMENTATION
+	Every state counts the references, calls,
+	compiles and allocations it makes and can
+	sample which script functions are running,
+	see state::stats and state::start_profiling.
+	Without this option none of it is compiled.
 */
 
+#ifndef LUA_WRAPPER_NO_DEFAULTS
+#if !defined(LUA_WRAPPER_IMPLEMENTATION_LUAJIT) && !defined(LUA_WRAPPER_IMPLEMENTATION_LUA53)
 #define LUA_WRAPPER_IMPLEMENTATION_LUAJIT
-#define LUA_WRAPPER_STATELESS_STRINGS
+#endif
+#if !defined(LUA_WRAPPER_SINGLE_RETURN) && !defined(LUA_WRAPPER_TABLE_RETURN) && !defined(LUA_WRAPPER_VECTOR_RETURN)
 #define LUA_WRAPPER_TABLE_RETURN
+#endif
+#ifndef LUA_WRAPPER_STATELESS_STRINGS
+#define LUA_WRAPPER_STATELESS_STRINGS
+#endif
+#ifndef LUA_WRAPPER_SMART_FUNCTIONS
 #define LUA_WRAPPER_SMART_FUNCTIONS
+#endif
+#endif
 
 #if !defined(LUA_WRAPPER_SINGLE_RETURN) && !defined(LUA_WRAPPER_TABLE_RETURN) && !defined(LUA_WRAPPER_VECTOR_RETURN)
-#pragma error("No function return method selected")
+#error "No function return method selected"
+#endif
+
+#if !defined(LUA_WRAPPER_IMPLEMENTATION_LUAJIT) && !defined(LUA_WRAPPER_IMPLEMENTATION_LUA53)
+#error "No implementation selected"
+#endif
+
+#ifdef LUA_WRAPPER_REF_POOL
+#ifndef LUA_WRAPPER_REF_POOL_SIZE
+#define LUA_WRAPPER_REF_POOL_SIZE 1024
+#endif
+#ifndef LUA_WRAPPER_REF_POOL_BATCH
+#define LUA_WRAPPER_REF_POOL_BATCH 64
+#endif
+#endif
+
+#if defined(LUA_WRAPPER_CHUNK_CACHE) && !defined(LUA_WRAPPER_CHUNK_CACHE_SIZE)
+#define LUA_WRAPPER_CHUNK_CACHE_SIZE 256
+#endif
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+#define LUA_WRAPPER_COUNT(counter) (++(counter))
+#else
+#define LUA_WRAPPER_COUNT(counter) ((void)0)
+#endif
+
+#ifdef LUA_WRAPPER_MAPPED_FILES
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 #endif
 
-#if !defined(LUA_WRAPPER_IMPLEMENTATION_LUAJIT) || !defined(LUA_WRAPPER_IMPLEMENTATION_LUA53)
-#pragma error("No implementation selected")
+#ifdef LUA_WRAPPER_STATE_POOL
+#include <thread>
+#include <condition_variable>
+#include <deque>
 #endif
 
 namespace lua
@@ -68,37 +215,685 @@ namespace lua
 	using Number = lua_Number;
 	using Integer = lua_Integer;
 
+	enum class endianness
+	{
+		little,
+		big,
+	};
+
+	constexpr endianness native_endianness()
+	{
+#if defined(__BYTE_ORDER__) && defined(__ORDER_BIG_ENDIAN__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		return endianness::big;
+#else
+		return endianness::little;
+#endif
+	}
+
+	//converts between host and little endian byte order, both ways
+	uint64_t little_endian(uint64_t v);
+
+	//length without metamethods, lua_objlen is gone since Lua 5.2
+	size_t raw_length(lua_State *L, int idx);
+
 	class state;
+	class stack_frame;
+	class stack_guard;
 	class table_index;
 	class local;
+	class interned;
+	class scheduler;
+	class sandbox;
+	class memoized_function;
+	class error;
+	template<typename T>
+	class result;
+	class value_view;
+	class pairs_iterator;
+	class ipairs_iterator;
+	template<typename It>
+	class table_range;
+
+	template<typename T, typename Enable = void>
+	struct push_traits;
+	template<typename T, typename Enable = void>
+	struct get_traits;
+	template<typename T>
+	class class_;
+
+	/*
+		Allocator policies. A policy passed to a state must outlive it and
+		provide a reallocate function with the semantics of lua_Alloc
+		(nsize == 0 frees the block and returns nullptr).
+
+		NOTE: LuaJIT on 64-bit platforms without GC64 does not support custom
+		allocators, constructing a state with one throws in that case.
+	*/
+
+	//thread-local size-class pool for small objects, larger blocks go to malloc
+	class pool_allocator
+	{
+	public:
+		static const size_t granularity = 16;
+		static const size_t max_pooled = 512;
+		static const size_t chunk_size = 64 * 1024;
+
+		void* reallocate(void *ptr, size_t osize, size_t nsize);
+
+	private:
+		struct block
+		{
+			block *next;
+		};
+
+		struct cache
+		{
+			block *free[max_pooled / granularity];
+			cache();
+		};
+
+		struct chunk_list
+		{
+			std::mutex mutex;
+			std::vector<void*> chunks;
+			~chunk_list();
+		};
+
+		static cache& local_cache();
+		static chunk_list& chunks();
+		static size_t size_class(size_t size);
+
+		static void* allocate(size_t size);
+		static void deallocate(void *p, size_t size);
+	};
+
+	//bump allocator for states that are thrown away as a whole, freeing is a no-op
+	class arena_allocator
+	{
+	public:
+		arena_allocator(size_t blockSize = 256 * 1024);
+		~arena_allocator();
+
+		arena_allocator(const arena_allocator&) = delete;
+		arena_allocator& operator=(const arena_allocator&) = delete;
+
+		void* reallocate(void *ptr, size_t osize, size_t nsize);
+
+		void reset();
+		size_t capacity();
+
+	private:
+		struct block
+		{
+			block *prev;
+			size_t size;
+			size_t used;
+		};
+
+		static const size_t alignment = 16;
+		static const size_t header_size = (sizeof(block) + alignment - 1) & ~(alignment - 1);
+
+		block *head;
+		size_t blockSize;
+		char *last;
+
+		static size_t align(size_t size);
+		void* allocate(size_t size);
+	};
+
+#ifdef LUA_WRAPPER_MAPPED_FILES
+	//read-only mapping of a whole file, valid for the object's lifetime
+	class mapped_file
+	{
+	public:
+		explicit mapped_file(const char *path);
+		~mapped_file();
+
+		mapped_file(const mapped_file&) = delete;
+		mapped_file& operator=(const mapped_file&) = delete;
+
+		const char* data() const;
+		size_t size() const;
+
+	private:
+		const char *view;
+		size_t length;
+	};
+#endif
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+	//plain copy of a state's counters, safe to hand to other threads
+	struct state_stats
+	{
+		//registry references taken and released
+		size_t refs, unrefs;
+
+		//reference-type locals currently alive, stack locals included
+		size_t liveStrings, liveFunctions, liveUserdata, liveThreads, liveTables;
+
+		//protected calls made by the wrapper and how many of them failed
+		size_t calls, errors;
+
+		//chunks handed to the Lua compiler, chunk cache hits are not counted
+		size_t compiles;
+
+		size_t allocatedBytes, peakAllocatedBytes, allocations;
+
+		//gc_step and gc_collect calls and their time, collections Lua starts itself are not seen
+		size_t gcSteps;
+		double gcSeconds;
+
+		//calls answered by a memoized_function's cache and calls that went to Lua
+		size_t memoHits, memoMisses;
+	};
+
+	struct profile_entry
+	{
+		//"name (source:line)" of the sampled function
+		std::string function;
+		size_t samples;
+		double seconds;
+	};
+#endif
+
+	/*
+		Flags for state::open_libs. On LuaJIT and Lua 5.1 coroutine comes with base,
+		and LuaJIT only turns its trace compiler on when jit is opened. ffi is put in
+		package.preload when package is opened as well, like luaL_openlibs does, and
+		set as a global otherwise. Libraries the build does not have are ignored.
+	*/
+	struct libs
+	{
+		enum : unsigned int
+		{
+			base = 1 << 0,
+			package = 1 << 1,
+			coroutine = 1 << 2,
+			table = 1 << 3,
+			io = 1 << 4,
+			os = 1 << 5,
+			string = 1 << 6,
+			math = 1 << 7,
+			utf8 = 1 << 8,
+			debug = 1 << 9,
+			bit = 1 << 10,
+			jit = 1 << 11,
+			ffi = 1 << 12,
+
+			all = ~0u,
+		};
+	};
 
 	class state
 	{
 		friend class local;
 		friend class table_index;
+		friend class stack_frame;
+		friend class stack_guard;
+		template<typename F>
+		friend class function_binder;
+		template<typename T>
+		friend class class_;
+		friend class scheduler;
+		friend class sandbox;
+		friend class memoized_function;
+		friend class state_pool;
+		friend struct get_traits<local>;
+		friend class value_view;
+		friend class pairs_iterator;
+		friend class ipairs_iterator;
+		template<typename It>
+		friend class table_range;
 
 	public:
 		state();
+		state(lua_Alloc f, void *ud);
+		template<typename A, typename = typename std::enable_if<!std::is_same<A, state>::value>::type>
+		explicit state(A &allocator);
 		state(state &&s);
 		~state();
 
 		operator lua_State*();
 
+		//the state that created L or one of its threads, kept current across moves
+		static state* owner(lua_State *L);
+
 		state(const state&) = delete;
 		state& operator=(const state&) = delete;
 
 		void open_libs();
+		//opens only the libraries whose libs flags are set in mask
+		void open_libs(unsigned int mask);
+
+		//registers a module for require without building it
+		void preload(const char *name, lua_CFunction open);
+		//build runs the first time a script requires name, its result becomes the module
+		void preload(const char *name, std::function<local(state&)> build);
+
+		size_t allocated_bytes();
+		size_t peak_allocated_bytes();
+		size_t allocation_count();
+		void set_memory_limit(size_t bytes);
+
+		//garbage collector controls, sizes are in kilobytes
+		void gc_collect();
+		//returns true if the step finished a collection cycle
+		bool gc_step(int kilobytes = 0);
+		//steps until a cycle finishes or the budget is spent, returns true in the former case
+		bool gc_idle(std::chrono::steady_clock::duration budget, int kilobytes = 0);
+		void gc_stop();
+		void gc_restart();
+		//asks the collector where LUA_GCISRUNNING exists, LuaJIT can not be queried so there
+		//it only reflects gc_stop and gc_restart, not collectgarbage calls made by scripts
+		bool gc_running();
+		//both take and return percentages, the previous value is returned
+		int gc_set_pause(int percent);
+		int gc_set_step_multiplier(int percent);
+#ifdef LUA_GCGEN
+		//0 keeps the current value of a parameter
+		void gc_generational(int minorMultiplier = 0, int majorMultiplier = 0);
+		void gc_incremental(int pause = 0, int stepMultiplier = 0, int stepSize = 0);
+#endif
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		state_stats stats();
+		//zeroes every counter except the live local counts
+		void reset_stats();
+
+		/*
+			Samples the running script function every `instructions` VM instructions
+			and charges it with the time since the previous sample. Under LuaJIT
+			compiled traces do not run hooks, so their time lands on the next
+			interpreted function.
+		*/
+		void start_profiling(int instructions = 1000);
+		void stop_profiling();
+		//entries sorted by time, most expensive first
+		std::vector<profile_entry> profile();
+		void clear_profile();
+#endif
 
 		void do_string(const char *n);
 
+		//error messages get a traceback, the handler is created once and kept in the registry
+		void set_traceback(bool enabled);
+
+		local load_string(const char *s, const char *name = nullptr);
+		local load_file(const char *path);
+		local load_bytecode(const char *data, size_t len, const char *name = "=bytecode");
+#ifdef LUA_WRAPPER_MAPPED_FILES
+		//compiles straight from a mapping of the file, source or bytecode
+		local load_file_mmap(const char *path);
+#endif
+		/*
+			Compiles a chunk handed over in pieces, source or bytecode. reader is called
+			as reader(size_t &size) and returns the next piece, or nullptr or a size of 0
+			at the end. A piece must stay valid until the next call, exceptions thrown
+			by reader are rethrown once lua_load has returned.
+		*/
+		template<typename F>
+		local load(F &&reader, const char *name = "=stream");
+		std::string dump(const local &fn);
+
+		/*
+			Copies of value graphs between states. Tables are followed recursively and a
+			table reached twice, cycles included, is copied once and shared again on the
+			other side, metatables are not copied. Functions, userdata, threads and cdata
+			cannot be serialized, transfer also takes light userdata and plain C functions
+			since they stay meaningful within the process. Nesting deeper than
+			max_copy_depth tables throws.
+		*/
+		static const int max_copy_depth = 128;
+
+		std::string serialize(const local &value);
+		local deserialize(const std::string &data);
+		local deserialize(const char *data, size_t len);
+		//copies a local of this state straight onto the stack of to
+		local transfer(const local &value, state &to);
+
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		/*
+			Zero-copy buffers for the LuaJIT FFI. share hands scripts a `ctype*` cdata
+			pointing straight at C++ memory, ctype being any type the ffi module knows
+			("uint8_t", a struct declared with ffi.cdef). The plain overloads do not own
+			the memory, it must outlive every use a script makes of the pointer, the
+			shared_ptr overload keeps owner alive until the cdata is collected.
+			Requires the ffi library, opened or preloaded.
+		*/
+		local share(void *data, const char *ctype);
+		template<typename T>
+		local share(std::shared_ptr<T> owner, const char *ctype);
+#ifdef LUA_WRAPPER_HAS_SPAN
+		template<typename T>
+		local share(std::span<T> data, const char *ctype);
+#endif
+
+		//the address held by a pointer cdata, like the ones share returns
+		template<typename T>
+		T* cdata_pointer(const local &cdata);
+		//the memory of a struct or array cdata made by ffi.new, valid while the local is
+		template<typename T>
+		T* cdata_payload(const local &cdata, size_t *count = nullptr);
+#ifdef LUA_WRAPPER_HAS_SPAN
+		template<typename T>
+		std::span<T> cdata_span(const local &array);
+#endif
+#endif
+
+#ifdef LUA_WRAPPER_CHUNK_CACHE
+		std::string save_chunk_cache();
+		void load_chunk_cache(const std::string &data);
+		void clear_chunk_cache();
+		size_t chunk_cache_size();
+		//least recently used chunks are dropped beyond n, 0 disables caching
+		void set_chunk_cache_capacity(size_t n);
+		size_t chunk_cache_capacity();
+#endif
+
 		local create_table(int narr = 0, int nrec = 0);
+		local create_thread(const local &fn);
 		local create_string(const char *s);
+		local create_string(const char *s, size_t len);
+#ifdef LUA_WRAPPER_HAS_CPP17
+		local create_string(std::string_view s);
+#endif
+
+		template<typename T>
+		local create_table_from(const T *data, size_t n);
+		template<typename C>
+		local create_table_from(const C &c);
 
 		local get_global(const char *n);
-		void set_global(local lcl, const char *n);
+		void set_global(const local &lcl, const char *n);
+		local get_global(const interned &n);
+		void set_global(const local &lcl, const interned &n);
+
+		interned intern(const char *s);
+
+		//one pass over the globals table, names may be const char* or interned
+		template<typename K, typename... T>
+		void get_globals(std::initializer_list<K> names, T&... out);
+		template<typename K, typename... T>
+		void set_globals(std::initializer_list<K> names, const T&... values);
+
+#ifdef LUA_WRAPPER_REF_POOL
+		void reserve_refs(int n);
+		void flush_refs();
+		size_t live_refs();
+		size_t peak_refs();
+#endif
 
 	private:
 		lua_State * L;
+
+		//innermost active stack_frame, nullptr if reference-type locals go to the registry
+		stack_frame *frame;
+
+		//only present if the state was created with an allocator
+		struct memory_context
+		{
+			lua_Alloc f;
+			void *ud;
+			size_t bytes, peakBytes, allocations, limit;
+		};
+
+		std::unique_ptr<memory_context> memory;
+
+		void init_memory(lua_Alloc f, void *ud);
+		static void* counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+		template<typename A>
+		static void* policy_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+		void init();
+
+		//registry[&ownerKey] = this
+		static char ownerKey;
+		void register_owner();
+		//nullptr instead of throwing, for lua_CFunctions
+		static state* find_owner(lua_State *L);
+		//copies a value from the stack of L, which may be a thread, into a registry local
+		local get_argument(lua_State *from, int idx);
+
+		//a stack_frame's slots are out of reach from a C call's own stack, locals made there go to the registry
+		struct frame_suspension
+		{
+			state *s;
+			stack_frame *frame;
+
+			explicit frame_suspension(state *s);
+			~frame_suspension();
+		};
+
+		int ref();
+		int share_ref(int r);
+		void unref(int r);
+		void push_ref(int r);
+
+#ifdef LUA_WRAPPER_REF_POOL
+		int poolRef, poolCapacity, poolNext;
+		std::vector<int> poolFree, poolPending;
+		size_t liveRefs, peakRefs;
+
+		void init_ref_pool();
+#endif
+
+#ifdef LUA_WRAPPER_SHARED_REFS
+		//number of locals sharing each reference, indexed by reference
+		std::vector<uint32_t> refCounts;
+#endif
+
+		//interned strings live as long as the state, keyed by their contents
+		std::unordered_map<std::string, int> interns;
+
+		void push_globals();
+
+		template<typename T>
+		T get_value(int idx);
+		template<typename... T>
+		void pop_values(T&... out);
+		void check_fields(size_t keys, size_t values, int slots);
+		template<typename K, typename... T>
+		void get_fields_at(int tbl, std::initializer_list<K> keys, T&... out);
+		template<typename K, typename... T>
+		void set_fields_at(int tbl, std::initializer_list<K> keys, const T&... values);
+
+		bool tracebacks = false;
+		int errorHandler = LUA_NOREF;
+		//set when the last protected_call failed under the handler, compile errors never have a traceback
+		bool tracebackPending = false;
+
+		//only read where LUA_GCISRUNNING is missing
+		bool gcStopped = false;
+		int gc_control(int what, int data);
+
+		std::unordered_map<std::string, std::function<local(state&)>> modules;
+
+		enum class wire : uint8_t
+		{
+			nil,
+			boolean_false,
+			boolean_true,
+			number,
+			integer,
+			string,
+			table,
+			table_ref,
+			table_end,
+		};
+
+		//tables already written or copied, keyed by lua_topointer
+		using table_ids = std::unordered_map<const void*, uint64_t>;
+
+		static int absolute(lua_State *L, int idx);
+		void write_value(std::string &out, int idx, table_ids &tables, int depth);
+		void read_value(const char *&p, const char *end, int tables, uint64_t &count, int depth);
+		void copy_value_to(state &to, int idx, table_ids &tables, int seen, int depth);
+
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		int ffiRef = LUA_NOREF;
+		//ffi.typeof(ctype .. "*") by ctype, parsing a declaration is far slower than a lookup
+		std::unordered_map<std::string, int> pointerTypes;
+
+		void push_ffi(const char *name);
+		void push_pointer_type(const char *ctype);
+		const void* cdata_address(const local &cdata);
+		template<typename T>
+		static int release_owner(lua_State *L);
+		template<typename T>
+		static int destroy_owner(lua_State *L);
+#endif
+
+		void open_library(const char *name, lua_CFunction open);
+		void push_preload();
+		static int load_module(lua_State *L);
+
+		//traceback false skips the handler, for callers that never build a lua::error
+		int protected_call(int nargs, int nresults, bool traceback = true);
+		local pop_error();
+		local take_traceback();
+		void clear_traceback();
+		[[noreturn]] void raise_error();
+		static int traceback_handler(lua_State *L);
+
+		void push_chunk(const char *s, size_t len, const char *name);
+		void push_function_local(local &lcl);
+
+		template<typename F>
+		struct stream_reader
+		{
+			F *reader;
+			std::exception_ptr error;
+		};
+
+		template<typename F>
+		static const char* read_stream(lua_State *L, void *ud, size_t *size);
+		int load_stream(lua_Reader reader, void *ud, const char *name);
+		static int dump_writer(lua_State *L, const void *p, size_t sz, void *ud);
+		void dump_top(std::string &bc);
+
+#ifdef LUA_WRAPPER_CHUNK_CACHE
+		struct cached_chunk
+		{
+			uint64_t hash;
+			std::string source;
+			std::string name;
+			int ref;
+		};
+
+		using chunk_list = std::list<cached_chunk>;
+
+		//most recently used first
+		chunk_list chunkEntries;
+		//keyed by hash_chunk of the source, colliding entries are told apart by their source
+		std::unordered_multimap<uint64_t, chunk_list::iterator> chunkCache;
+		size_t chunkCapacity = LUA_WRAPPER_CHUNK_CACHE_SIZE;
+
+		static uint64_t hash_chunk(const char *s, size_t len);
+		chunk_list::iterator find_cached_chunk(uint64_t h, const char *s, size_t len);
+		void add_cached_chunk(uint64_t h, const char *s, size_t len, const char *name);
+		void evict_chunks(size_t keep);
+#endif
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		state_stats counters = {};
+
+		bool profiling = false;
+		std::chrono::steady_clock::time_point lastSample;
+		//keyed by lua_topointer of the sampled function
+		std::unordered_map<const void*, profile_entry> samples;
+
+		void register_profiler();
+		static void profile_hook(lua_State *L, lua_Debug *ar);
+#endif
+
+	};
+
+	/*
+		While a stack_frame is alive, every reference-type local created on its
+		state is stored in a slot on the Lua stack instead of in the registry.
+		All slots are released with a single lua_settop when the frame is destroyed,
+		so stack locals must not outlive the frame that created them. Copying a stack
+		local always produces a registry-backed local, moving it keeps the slot.
+
+		Frames must be strictly nested, and values pushed manually onto the stack
+		inside a frame should be accessed by negative index only, since new slots are
+		inserted beneath them.
+	*/
+	class stack_frame
+	{
+		friend class local;
+		friend class stack_guard;
+
+	public:
+		stack_frame(state &s);
+		~stack_frame();
+
+		stack_frame(const stack_frame&) = delete;
+		stack_frame& operator=(const stack_frame&) = delete;
+
+		int size();
+
+	private:
+		state *s;
+		stack_frame *prev;
+		int base, top;
+
+		int push_slot();
+	};
+
+	/*
+		Records the top of a state's stack and restores it when destroyed, so values
+		pushed in its scope are dropped together even if an exception is thrown.
+		reserve grows the stack once for a whole batch of pushes. Stack locals created
+		inside the guard are kept, their slots are taken into account when restoring.
+		Debug builds assert that nothing below the recorded top was popped.
+	*/
+	class stack_guard
+	{
+	public:
+		explicit stack_guard(state &s, int reserve = 0);
+		~stack_guard();
+
+		stack_guard(const stack_guard&) = delete;
+		stack_guard& operator=(const stack_guard&) = delete;
+
+		//makes room for n more values, throws if the stack cannot grow that far
+		void reserve(int n);
+		//number of values pushed since the guard was created
+		int size() const;
+
+	private:
+		lua_State *L;
+		stack_frame *frame;
+		int top, frameTop;
+
+		int mark() const;
+	};
+
+	/*
+		A string that is pushed once and then pinned in the registry by its state
+		for the state's lifetime, so using it as a key costs a single lua_rawgeti.
+		Obtained through state::intern, copies are free.
+	*/
+	class interned
+	{
+		friend class state;
+		friend class table_index;
+		friend class local;
+		friend class memoized_function;
+		friend struct push_traits<interned>;
+
+	public:
+		interned();
+
+		bool is_valid() const;
+
+	private:
+		lua_State *L;
+		int ref;
+
+		interned(lua_State *L, int ref);
+
+		void push(lua_State *L) const;
 	};
 
 	class table_index
@@ -110,21 +905,53 @@ namespace lua
 
 		operator local();
 		//table_index& operator=(local &rhs);
-		table_index& operator=(local rhs);
+		table_index& operator=(const local &rhs);
 
 	private:
+		/*
+			Integer and other value-type keys are stored inline, only reference-type
+			keys are pinned in the registry. Every key type goes through
+			lua_gettable/lua_settable so __index and __newindex apply alike.
+		*/
+		enum class key_type
+		{
+			none,
+			integer,
+			number,
+			boolean,
+			lightuserdata,
+			ref,
+			interned,
+		};
+
 		state * s;
-		int tblRef, idxRef;
+		local *tbl;
+		key_type kt;
 
-		table_index(state &s, int tblRef, local &idx);
+		union
+		{
+			lua_Integer integer;
+			lua_Number number;
+			bool boolean;
+			void *lightuserdata;
+			int ref;
+		} key;
+
+		table_index(state &s, local &tbl, const local &idx);
+		table_index(state &s, local &tbl, lua_Integer idx);
+		table_index(state &s, local &tbl, const interned &idx);
 		table_index();
 
 		table_index(const table_index &ti);
 
 		table_index& operator=(const table_index &rhs);
+		table_index& operator=(table_index &&rhs);
 
 		void check_valid();
 
+		void push_key();
+		void release_key();
+
 		local get_value();
 	};
 
@@ -132,6 +959,14 @@ namespace lua
 	{
 		friend class state;
 		friend class table_index;
+		friend struct push_traits<local>;
+		template<typename T>
+		friend class class_;
+		friend class state_pool;
+		friend class scheduler;
+		friend class error;
+		friend class value_view;
+		friend class memoized_function;
 
 	public:
 		local();
@@ -148,8 +983,13 @@ namespace lua
 		local(state &s, const char *str);
 		local(state &s, lua_CFunction f);
 		local(state &s, void *p);
+#ifdef LUA_WRAPPER_HAS_CPP17
+		local(std::string_view str);
+		local(state &s, std::string_view str);
+#endif
 		~local();
 		local& operator=(const local &rhs);
+		local& operator=(local &&rhs);
 
 		bool is_nil();
 		bool is_boolean();
@@ -162,12 +1002,20 @@ namespace lua
 		bool is_lightuserdata();
 		bool is_thread();
 		bool is_table();
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		bool is_cdata();
+#endif
+		bool is_stack_local();
 
 		void set_as_nil();
 		void set_as_boolean(bool b);
 		void set_as_number(lua_Number n);
 		void set_as_integer(lua_Integer i);
 		void set_as_string(const char *s);
+		void set_as_string(const char *s, size_t len);
+#ifdef LUA_WRAPPER_HAS_CPP17
+		void set_as_string(std::string_view s);
+#endif
 		void set_as_cfunction(lua_CFunction f);
 #ifdef LUA_WRAPPER_SMART_FUNCTIONS
 		void set_as_function(std::function<void()> f);
@@ -177,20 +1025,45 @@ namespace lua
 		bool to_boolean();
 		lua_Number to_number();
 		lua_Integer to_integer();
-		const char* to_string();
+		const char* to_string(size_t *len = nullptr);
+#ifdef LUA_WRAPPER_HAS_CPP17
+		std::string_view to_string_view();
+#endif
 		lua_CFunction to_cfunction();
 		void* to_userdata();
 
-		void table_set(local key, local value);
-		void table_set(lua_Integer key, local value);
-		local table_get(local key);
+		void table_set(const local &key, const local &value);
+		void table_set(lua_Integer key, const local &value);
+		local table_get(const local &key);
 		local table_get(lua_Integer key);
+		void table_set(const interned &key, const local &value);
+		local table_get(const interned &key);
 
-		size_t length();
+		//reads or writes several fields with a single push of the table, keys may be const char* or interned
+		template<typename K, typename... T>
+		void get_fields(std::initializer_list<K> keys, T&... out);
+		template<typename K, typename... T>
+		void set_fields(std::initializer_list<K> keys, const T&... values);
+
+		template<typename T>
+		size_t table_read_into(T *out, size_t n);
+		template<typename T>
+		void table_append(const T *data, size_t n);
+		template<typename It>
+		void table_append(It first, It last);
+		template<typename C>
+		void table_append(const C &c);
+
+		size_t length();
+
+		table_range<pairs_iterator> pairs();
+		//raw access from 1 up to the first nil, like ipairs
+		table_range<ipairs_iterator> ipairs();
 
 #ifdef LUA_WRAPPER_INDEXABLE_LOCALS
-		table_index& operator[](local key);
+		table_index& operator[](const local &key);
 		table_index& operator[](lua_Integer key);
+		table_index& operator[](const interned &key);
 		//table_index& operator[](const std::string &key);
 #endif
 
@@ -199,22 +1072,40 @@ namespace lua
 		local& operator=(lua_CFunction rhs);
 		local& operator=(void *p);
 		local& operator=(const char *s);
+#ifdef LUA_WRAPPER_HAS_CPP17
+		local& operator=(std::string_view s);
+#endif
 
 		
 #if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
 		template<typename T, typename... Args>
-		local operator()(T arg, Args... args);
+		local operator()(const T &arg, const Args&... args);
 		template<typename T>
-		local operator()(T arg);
+		local operator()(const T &arg);
 		local operator()();
-#elif define(LUA_WRAPPER_VECTOR_RETURN)
+#elif defined(LUA_WRAPPER_VECTOR_RETURN)
 		template<typename T, typename... Args>
-		std::vector<local> operator()(T arg, Args... args);
+		std::vector<local> operator()(const T &arg, const Args&... args);
 		template<typename T>
-		std::vector<local> operator()(T arg);
+		std::vector<local> operator()(const T &arg);
 		std::vector<local> operator()();
 #endif
 
+		template<typename... R, typename... Args>
+		std::tuple<R...> call(const Args&... args);
+
+		//Lua errors are returned instead of thrown
+		template<typename... R, typename... Args>
+		result<std::tuple<R...>> try_call(const Args&... args);
+
+		//caches the results of the last capacity distinct calls, see memoized_function
+		memoized_function memoized(size_t capacity = 256);
+
+		//missing results are nil, extra ones are dropped
+		template<typename... R, typename... Args>
+		std::tuple<R...> resume(const Args&... args);
+		bool is_resumable();
+
 	private:
 		enum class type
 		{
@@ -225,6 +1116,7 @@ namespace lua
 			string,
 #ifdef LUA_WRAPPER_STATELESS_STRINGS
 			stateless_string,
+			small_string,
 #endif
 			function,
 			cfunction,
@@ -237,52 +1129,98 @@ namespace lua
 			lightuserdata,
 			thread,
 			table,
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+			cdata,
+#endif
 		};
 
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		//what lua_type returns for cdata, lua.h has no name for it
+		static const int cdata_type = 10;
+#endif
+
 		void copy_value(const local &lcl);
 
-		bool is_ref_type();
+		bool is_ref_type() const;
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		void count_live(bool alive);
+#endif
 		int duplicate_ref();
 		void release();
 
 		void load_ref_value_no_type(int idx = -1);
 		void load_ref_value(int idx = -1);
 		void load_value(int idx = -1);
+		bool has_upvalues(int idx);
 
-		void push_ref_value();
-		void push_value(lua_State *L = nullptr);
+		void push_ref_value() const;
+		void push_ref_value(lua_State *L) const;
+		void push_value(lua_State *L = nullptr) const;
 
 		static lua_Integer numberToInteger(lua_Number number);
-		void integerize();
+		static bool is_integral(lua_Number number, lua_Integer &integer);
+		static constexpr lua_Number integer_upper_bound();
+		void store_number(lua_Number n);
+
 
 #ifdef LUA_WRAPPER_STATELESS_STRINGS
-		static char* create_string(const char *s);
+		struct string_header
+		{
+			std::atomic<uint32_t> refc;
+			size_t length;
+		};
+
+		//short strings are stored inline, the last byte holds the unused capacity so a full buffer doubles as the terminator
+		static const size_t small_string_capacity = 15;
+		struct small_string
+		{
+			char data[small_string_capacity + 1];
+		};
+
+		void set_stateless_string(const char *s, size_t len);
+		const char* stateless_data() const;
+		size_t stateless_length() const;
+
+		static char* create_string(const char *s, size_t len);
 		static char* copy_string(char *s);
 		static void release_string(char *s);
-		static uint32_t* get_string_refc(char *s);
+		static string_header* get_string_header(char *s);
 #endif
 
 		void check_state();
-		void check_state_consistancy(lua_State *L);
+		void check_state_consistancy(lua_State *L) const;
 		void check_is_function();
 		void check_is_table();
 
 		void prep_call();
+		void pcall(int nresults);
+
+		lua_State* to_thread();
+		static int resume_thread(lua_State *co, lua_State *from, int nargs);
 #if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
-		local do_call();
-#elif define(LUA_WRAPPER_VECTOR_RETURN)
-		std::vector<local> do_call();
+		local do_call(const stack_guard &guard);
+#elif defined(LUA_WRAPPER_VECTOR_RETURN)
+		std::vector<local> do_call(const stack_guard &guard);
 #endif
 
+		template<typename... R, size_t... I>
+		std::tuple<R...> get_results(std::index_sequence<I...>);
+		template<typename T>
+		T get_result(int idx);
+
 		template<typename T, typename... Args>
-		void push_call_args(T arg, Args... args);
+		void push_call_args(const T &arg, const Args&... args);
 		template<typename T>
-		void push_call_args(T arg);
+		void push_call_args(const T &arg);
+		void push_call_args();
 
 		state *s;
 		lua_State *L;
 
-		type t;
+		type t = type::nil;
+
+		//true if value.ref is an absolute stack index owned by a stack_frame
+		bool stacked = false;
 
 		union
 		{
@@ -296,954 +1234,6293 @@ namespace lua
 #ifdef LUA_WRAPPER_STATELESS_STRINGS
 			/*
 				NOTE: NOT a pointer to the base address of the memory allocation.
-				The first 4 bytes of the memory block is reservered for the reference
-				count. Must be used with the appropriate functions (create_string,
-				copy_string, and release_string).
+				The memory block starts with a string_header holding the reference
+				count and the length. Must be used with the appropriate functions
+				(create_string, copy_string, and release_string).
 			*/
 			char *string;
+			small_string inlined;
 #endif
 		} value;
 
 		table_index tindex;
 
-		uint32_t cargs;
+		uint32_t cargs = 0;
 	};
 
-	//nil value
-	const local nil;
-
-	/* state */
+	/*
+		Thrown for errors raised by Lua code. Holds the error value itself, which need
+		not be a string, and the traceback if the state has them enabled. The message
+		and the traceback are kept as Lua values until they are asked for.
 
-	state::state()
+		NOTE: holds references into its state, it must not outlive it.
+	*/
+	class error : public std::runtime_error
 	{
-		L = luaL_newstate();
-	}
+	public:
+		error(const local &value, const local &traceback);
 
-	state::state(state &&s) : L(s.L)
-	{
-		s.L = nullptr;
-	}
+		const char* what() const noexcept override;
+		const local& value() const;
+		bool has_traceback() const;
+		const std::string& traceback() const;
 
-	state::~state()
-	{
-		if (L != nullptr)
-			lua_close(L);
-	}
+		static std::string describe(const local &value);
 
-	state::operator lua_State*()
-	{
-		return L;
-	}
+	private:
+		local val;
+		local tb;
+		mutable std::string message;
+		mutable bool messageBuilt;
+		mutable std::string tbString;
+		mutable bool tbBuilt;
+	};
 
-	void state::open_libs()
+	/*
+		Either the results of a call or the error value it failed with. Failing does not
+		build any string or exception until value or message is used.
+	*/
+	template<typename T>
+	class result
 	{
-		luaL_openlibs(L);
-	}
+	public:
+		explicit result(T &&v);
+		explicit result(const local &err);
 
-	void state::do_string(const char *n)
-	{
-		if (luaL_dostring(L, n))
-		{
-			std::runtime_error err(lua_tostring(L, 1));
-			lua_pop(L, 1);
-			throw err;
-		}
-	}
+		bool ok() const;
+		explicit operator bool() const;
 
-	local state::create_table(int narr, int nrec)
+		//throws lua::error if the call failed
+		T& value();
+		const local& error() const;
+		std::string message() const;
+
+	private:
+		bool success;
+		T val;
+		local err;
+	};
+
+	/*
+		Table iteration. The range pushes the table when it is created and the iterator
+		keeps the current key and value above it, so iterating makes no references and
+		allocates nothing. Entries are views into the stack that are only turned into
+		locals on demand.
+
+		NOTE: a view is addressed relative to the top of the stack, it is only valid
+		until the iterator advances and while everything pushed in the loop body has
+		been popped again.
+	*/
+	class value_view
 	{
-		lua_createtable(L, narr, nrec);
+	public:
+		value_view(state &s, int idx, bool key = false);
 
-		local lcl(*this);
-		lcl.t = local::type::table;
-		lcl.load_ref_value_no_type();
+		int type() const;
+		bool is_nil() const;
 
-		return lcl;
-	}
+		template<typename T>
+		bool is() const;
+		template<typename T>
+		T as() const;
+		local get() const;
 
-	local state::create_string(const char *s)
+	private:
+		state *s;
+		int idx;
+		//lua_tostring on a number key would turn it into a string and break lua_next
+		bool key;
+	};
+
+	struct table_entry
 	{
-		local lcl(*this);
-		lcl.set_as_string(s);
-		return lcl;
-	}
+		value_view key;
+		value_view value;
+	};
 
-	local state::get_global(const char *n)
+	struct array_entry
 	{
-		lua_getglobal(L, n);
-		local lcl(*this);
-		lcl.load_value();
-		lua_pop(L, 1);
-		return lcl;
-	}
+		lua_Integer index;
+		value_view value;
+	};
 
-	void state::set_global(local lcl, const char *n)
+	class pairs_iterator
 	{
-		lua_setglobal(L, n);
-		lcl.push_value();
-	}
+	public:
+		pairs_iterator();
+		explicit pairs_iterator(state &s);
+		pairs_iterator(pairs_iterator &&it);
+		~pairs_iterator();
 
-	/* table_index */
+		pairs_iterator(const pairs_iterator&) = delete;
+		pairs_iterator& operator=(const pairs_iterator&) = delete;
 
-	table_index::operator local()
-	{
-		return get_value();
-	}
+		pairs_iterator& operator++();
+		table_entry operator*() const;
+		bool operator==(const pairs_iterator &rhs) const;
+		bool operator!=(const pairs_iterator &rhs) const;
 
-	/*
-	table_index& table_index::operator=(local &rhs)
-	{
-		check_valid();
-		rhs.check_state_consistancy(s->L);
-		lua_rawgeti(s->L, LUA_REGISTRYINDEX, tblRef);
-		lua_rawgeti(s->L, LUA_REGISTRYINDEX, idxRef);
-		rhs.push_value(s->L);
-		lua_settable(s->L, -3);
-		return *this;
-	}
-	*/
+	private:
+		state *s;
+		bool active;
 
-	table_index& table_index::operator=(local rhs)
-	{
-		check_valid();
-		rhs.check_state_consistancy(s->L);
-		lua_rawgeti(s->L, LUA_REGISTRYINDEX, tblRef);
-		lua_rawgeti(s->L, LUA_REGISTRYINDEX, idxRef);
-		rhs.push_value(s->L);
-		lua_settable(s->L, -3);
-		lua_pop(s->L, 1);
-		return *this;
-	}
+		void next();
+	};
 
-	table_index::table_index(state &s, int tblRef, local &idx)
+	class ipairs_iterator
 	{
-		idx.check_state_consistancy(s.L);
-		this->s = &s;
-		this->tblRef = tblRef;
-		idx.push_value(s.L);
-		idxRef = luaL_ref(s.L, LUA_REGISTRYINDEX);
-	}
+	public:
+		ipairs_iterator();
+		explicit ipairs_iterator(state &s);
+		ipairs_iterator(ipairs_iterator &&it);
+		~ipairs_iterator();
 
-	table_index::table_index() : s(nullptr)
-	{
-		tblRef = LUA_REFNIL;
-		idxRef = LUA_REFNIL;
-	}
+		ipairs_iterator(const ipairs_iterator&) = delete;
+		ipairs_iterator& operator=(const ipairs_iterator&) = delete;
 
-	table_index::table_index(const table_index &ti)
-	{
-		s = ti.s;
-		tblRef = ti.tblRef;
-		lua_rawgeti(s->L, LUA_REGISTRYINDEX, ti.idxRef);
-		idxRef = luaL_ref(s->L, LUA_REGISTRYINDEX);
-	}
+		ipairs_iterator& operator++();
+		array_entry operator*() const;
+		bool operator==(const ipairs_iterator &rhs) const;
+		bool operator!=(const ipairs_iterator &rhs) const;
 
-	table_index::~table_index()
-	{
-		if (idxRef != LUA_REFNIL)
-			luaL_unref(s->L, LUA_REGISTRYINDEX, idxRef);
-	}
+	private:
+		state *s;
+		lua_Integer i;
+		bool active;
 
-	table_index& table_index::operator=(const table_index &rhs)
-	{
-		if (idxRef != LUA_REFNIL)
-			luaL_unref(s->L, LUA_REGISTRYINDEX, idxRef);
-		s = rhs.s;
-		if (s != nullptr)
-		{
-			lua_rawgeti(s->L, LUA_REGISTRYINDEX, rhs.idxRef);
-			idxRef = luaL_ref(s->L, LUA_REGISTRYINDEX);
-			tblRef = rhs.tblRef;
-		}
-		else
-		{
-			tblRef = LUA_REFNIL;
-			idxRef = LUA_REFNIL;
-		}
-		return *this;
-	}
+		void next();
+	};
 
-	void table_index::check_valid()
+	//single pass, begin may only be called once
+	template<typename It>
+	class table_range
 	{
-		if (s == nullptr)
-			throw std::logic_error("Attempted to use an invalid table_index object");
-	}
+		friend class local;
 
-	local table_index::get_value()
-	{
-		check_valid();
-		if (tblRef == LUA_REFNIL)
-			throw std::logic_error("Attempt to get the value of a table_index that is not connected to a table");
-		lua_rawgeti(s->L, LUA_REGISTRYINDEX, tblRef);
-		lua_rawgeti(s->L, LUA_REGISTRYINDEX, idxRef);
-		lua_gettable(s->L, -2);
-		local l(*s);
-		l.load_value();
-		lua_pop(s->L, 2);
-		return l;
-	}
+	public:
+		table_range(table_range &&r);
+		~table_range();
 
-	/* local */
+		table_range(const table_range&) = delete;
+		table_range& operator=(const table_range&) = delete;
 
-	local::local() : s(nullptr), L(nullptr), t(type::nil)
-	{
+		It begin();
+		It end();
 
-	}
+	private:
+		state *s;
+		bool owns;
+		bool begun;
 
-	local::local(state &s) : s(&s), L(s.L)
-	{
+		explicit table_range(state &s);
+	};
 
-	}
+	/*
+		Typed marshalling. push_traits<T>::push pushes a T and push_traits<T>::count is
+		the number of stack slots it takes. get_traits<T>::get reads a T starting at the
+		given index and get_traits<T>::is tells whether the value there converts to T.
 
-	local::local(const local &lcl)
+		NOTE: const char* and std::string_view results point into Lua memory and are
+		only valid for as long as the Lua string is referenced. Calls and multi-value
+		getters pop what they read, so they refuse these types at compile time.
+	*/
+	template<typename... T>
+	struct push_count;
+
+	template<>
+	struct push_count<>
 	{
-		copy_value(lcl);
-	}
+		static const int value = 0;
+	};
 
-	local::local(bool b) : s(nullptr), L(nullptr), t(type::boolean)
+	//stack slots taken by pushing a T... in order
+	template<typename T, typename... Rest>
+	struct push_count<T, Rest...>
 	{
-		value.boolean = b;
-	}
+		static const int value = push_traits<T>::count + push_count<Rest...>::value;
+	};
 
-	local::local(lua_Number n) : s(nullptr), L(nullptr), t(type::number)
+	//whether any T points into a Lua value, these must not outlive the stack slot they were read from
+	template<typename... T>
+	struct borrows_stack;
+
+	template<>
+	struct borrows_stack<>
 	{
-		value.number = n;
-	}
+		static const bool value = false;
+	};
 
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-	local::local(const char *str) : s(nullptr), L(nullptr), t(type::stateless_string)
+	template<typename T, typename... Rest>
+	struct borrows_stack<T, Rest...>
 	{
-		value.string = create_string(str);
-	}
+		static const bool value = std::is_same<T, const char*>::value ||
+#ifdef LUA_WRAPPER_HAS_CPP17
+			std::is_same<T, std::string_view>::value ||
 #endif
+			borrows_stack<Rest...>::value;
+	};
 
-	local::local(lua_CFunction f) : s(nullptr), L(nullptr), t(type::cfunction)
+	template<>
+	struct push_traits<bool>
 	{
-		value.cfunction = f;
-	}
+		static const int count = 1;
+		static void push(lua_State *L, bool v) { lua_pushboolean(L, v); }
+	};
 
-	local::local(void *p) : s(nullptr), L(nullptr), t(type::lightuserdata)
+	template<typename T>
+	struct push_traits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
 	{
-		value.lightuserdata = p;
-	}
+		static const int count = 1;
+		static void push(lua_State *L, T v) { lua_pushinteger(L, static_cast<lua_Integer>(v)); }
+	};
 
-	local::local(state &s, bool b) : s(&s), L(s.L), t(type::boolean)
+	template<typename T>
+	struct push_traits<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
 	{
-		value.boolean = b;
-	}
+		static const int count = 1;
+		static void push(lua_State *L, T v) { lua_pushnumber(L, static_cast<lua_Number>(v)); }
+	};
 
-	local::local(state &s, lua_Number n) : s(&s), L(s.L), t(type::number)
+	template<typename T>
+	struct push_traits<T, typename std::enable_if<std::is_enum<T>::value>::type>
 	{
-		value.number = n;
-	}
+		static const int count = 1;
+		static void push(lua_State *L, T v) { lua_pushinteger(L, static_cast<lua_Integer>(v)); }
+	};
 
-	local::local(state &s, const char *str) : s(&s), L(s.L), t(type::string)
+	template<>
+	struct push_traits<std::nullptr_t>
 	{
-		lua_pushstring(L, str);
-		load_ref_value();
-	}
+		static const int count = 1;
+		static void push(lua_State *L, std::nullptr_t) { lua_pushnil(L); }
+	};
 
-	local::local(state &s, lua_CFunction f) : s(&s), L(s.L), t(type::cfunction)
+	template<>
+	struct push_traits<const char*>
 	{
-		value.cfunction = f;
-	}
+		static const int count = 1;
+		static void push(lua_State *L, const char *v) { if (v != nullptr) lua_pushstring(L, v); else lua_pushnil(L); }
+	};
 
-	local::local(state &s, void *p) : s(&s), L(s.L), t(type::lightuserdata)
-	{
-		value.lightuserdata = p;
-	}
+	template<>
+	struct push_traits<char*> : push_traits<const char*> { };
+
+	template<size_t N>
+	struct push_traits<char[N]> : push_traits<const char*> { };
 
-	local::local(local &&lcl) : s(lcl.s), L(lcl.L), t(lcl.t), value(lcl.value), cargs(0)
+	template<>
+	struct push_traits<std::string>
 	{
-		lcl.t = type::nil;
-	}
+		static const int count = 1;
+		static void push(lua_State *L, const std::string &v) { lua_pushlstring(L, v.data(), v.size()); }
+	};
 
-	local::~local()
+	template<>
+	struct push_traits<lua_CFunction>
 	{
-		release();
-	}
+		static const int count = 1;
+		static void push(lua_State *L, lua_CFunction v) { lua_pushcfunction(L, v); }
+	};
 
-	local& local::operator=(const local &rhs)
+	template<typename T>
+	struct push_traits<T*, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value && !std::is_function<T>::value>::type>
 	{
-		release();
-		copy_value(rhs);
+		static const int count = 1;
+		static void push(lua_State *L, T *v) { lua_pushlightuserdata(L, const_cast<void*>(static_cast<const void*>(v))); }
+	};
 
+	template<>
+	struct push_traits<local>
+	{
+		static const int count = 1;
+		static void push(lua_State *L, const local &v);
+	};
+
+	template<>
+	struct push_traits<interned>
+	{
+		static const int count = 1;
+		static void push(lua_State *L, const interned &v) { v.push(L); }
+	};
+
+	template<typename... Ts>
+	struct push_traits<std::tuple<Ts...>>
+	{
+		static const int count = push_count<Ts...>::value;
+
+		static void push(lua_State *L, const std::tuple<Ts...> &v)
+		{
+			push(L, v, std::index_sequence_for<Ts...>());
+		}
+
+		template<size_t... I>
+		static void push(lua_State *L, const std::tuple<Ts...> &v, std::index_sequence<I...>)
+		{
+			int expand[] = { 0, (push_traits<Ts>::push(L, std::get<I>(v)), 0)... };
+			(void)expand;
+		}
+	};
+
+	template<>
+	struct get_traits<bool>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_isboolean(L, idx); }
+		static bool get(lua_State *L, int idx) { return lua_toboolean(L, idx) != 0; }
+	};
+
+	template<typename T>
+	struct get_traits<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type>
+	{
+		static const int count = 1;
+		//lua_isnumber would also accept numeric strings
+		static bool is(lua_State *L, int idx) { return lua_type(L, idx) == LUA_TNUMBER; }
+		static T get(lua_State *L, int idx) { return static_cast<T>(lua_tointeger(L, idx)); }
+	};
+
+	template<typename T>
+	struct get_traits<T, typename std::enable_if<std::is_floating_point<T>::value>::type>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_type(L, idx) == LUA_TNUMBER; }
+		static T get(lua_State *L, int idx) { return static_cast<T>(lua_tonumber(L, idx)); }
+	};
+
+	template<typename T>
+	struct get_traits<T, typename std::enable_if<std::is_enum<T>::value>::type>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_type(L, idx) == LUA_TNUMBER; }
+		static T get(lua_State *L, int idx) { return static_cast<T>(lua_tointeger(L, idx)); }
+	};
+
+	template<>
+	struct get_traits<const char*>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_isstring(L, idx) != 0; }
+		static const char* get(lua_State *L, int idx) { return lua_tostring(L, idx); }
+	};
+
+	template<>
+	struct get_traits<std::string>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_isstring(L, idx) != 0; }
+		static std::string get(lua_State *L, int idx)
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, idx, &len);
+			return s != nullptr ? std::string(s, len) : std::string();
+		}
+	};
+
+	template<>
+	struct get_traits<lua_CFunction>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_iscfunction(L, idx) != 0; }
+		static lua_CFunction get(lua_State *L, int idx) { return lua_tocfunction(L, idx); }
+	};
+
+	//nil is nullptr, class pointers need userdata registered with class_, other pointers light userdata
+	template<typename T>
+	struct get_traits<T*, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value && !std::is_function<T>::value>::type>
+	{
+		using pointee = typename std::remove_cv<T>::type;
+
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_isnil(L, idx) || is(L, idx, std::is_class<pointee>()); }
+		static T* get(lua_State *L, int idx) { return lua_isnil(L, idx) ? nullptr : get(L, idx, std::is_class<pointee>()); }
+
+	private:
+		static bool is(lua_State *L, int idx, std::true_type) { return class_<pointee>::is(L, idx); }
+		static bool is(lua_State *L, int idx, std::false_type) { return lua_islightuserdata(L, idx); }
+		static T* get(lua_State *L, int idx, std::true_type) { return class_<pointee>::check(L, idx); }
+		static T* get(lua_State *L, int idx, std::false_type) { return static_cast<T*>(lua_touserdata(L, idx)); }
+	};
+
+	//bound functions taking a local get a registry local of the state that owns L
+	template<>
+	struct get_traits<local>
+	{
+		static const int count = 1;
+		static bool is(lua_State *, int) { return true; }
+		static local get(lua_State *L, int idx);
+	};
+
+	//tuples read consecutive stack slots, nested multi-slot values are not supported
+	template<typename... Ts>
+	struct get_traits<std::tuple<Ts...>>
+	{
+		static const int count = sizeof...(Ts);
+
+		static bool is(lua_State *L, int idx)
+		{
+			return is(L, absolute(L, idx), std::index_sequence_for<Ts...>());
+		}
+
+		static std::tuple<Ts...> get(lua_State *L, int idx)
+		{
+			return get(L, absolute(L, idx), std::index_sequence_for<Ts...>());
+		}
+
+		static int absolute(lua_State *L, int idx)
+		{
+			return idx < 0 && idx > LUA_REGISTRYINDEX ? lua_gettop(L) + idx + 1 : idx;
+		}
+
+		template<size_t... I>
+		static bool is(lua_State *L, int idx, std::index_sequence<I...>)
+		{
+			bool r = true;
+			bool expand[] = { true, (r = r && get_traits<Ts>::is(L, idx + static_cast<int>(I)))... };
+			(void)expand;
+			return r;
+		}
+
+		template<size_t... I>
+		static std::tuple<Ts...> get(lua_State *L, int idx, std::index_sequence<I...>)
+		{
+			return std::tuple<Ts...>(get_traits<Ts>::get(L, idx + static_cast<int>(I))...);
+		}
+	};
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	template<>
+	struct push_traits<std::string_view>
+	{
+		static const int count = 1;
+		static void push(lua_State *L, std::string_view v) { lua_pushlstring(L, v.data(), v.size()); }
+	};
+
+	template<typename T>
+	struct push_traits<std::optional<T>>
+	{
+		static const int count = 1;
+		static void push(lua_State *L, const std::optional<T> &v) { if (v) push_traits<T>::push(L, *v); else lua_pushnil(L); }
+	};
+
+	template<>
+	struct get_traits<std::string_view>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_isstring(L, idx) != 0; }
+		static std::string_view get(lua_State *L, int idx)
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, idx, &len);
+			return s != nullptr ? std::string_view(s, len) : std::string_view();
+		}
+	};
+
+	template<typename T>
+	struct get_traits<std::optional<T>>
+	{
+		static const int count = 1;
+		static bool is(lua_State *L, int idx) { return lua_isnoneornil(L, idx) || get_traits<T>::is(L, idx); }
+		static std::optional<T> get(lua_State *L, int idx)
+		{
+			if (lua_isnoneornil(L, idx))
+				return std::nullopt;
+			return get_traits<T>::get(L, idx);
+		}
+	};
+#endif
+
+	/*
+		Function binding. function_traits describes the result and argument types
+		of free functions, member functions and callable objects. Member functions
+		take the object pointer as their first Lua argument.
+	*/
+	template<bool Method, typename R, typename... A>
+	struct callable_traits
+	{
+		using result_type = R;
+		using argument_types = std::tuple<typename std::decay<A>::type...>;
+		using object_type = void;
+		static const bool is_method = Method;
+		static const size_t arity = sizeof...(A);
+	};
+
+	template<typename M>
+	struct functor_traits;
+
+	template<typename C, typename R, typename... A>
+	struct functor_traits<R(C::*)(A...)> : callable_traits<false, R, A...> { };
+
+	template<typename C, typename R, typename... A>
+	struct functor_traits<R(C::*)(A...) const> : callable_traits<false, R, A...> { };
+
+	template<typename F>
+	struct function_traits : functor_traits<decltype(&F::operator())> { };
+
+	template<typename R, typename... A>
+	struct function_traits<R(A...)> : callable_traits<false, R, A...> { };
+
+	template<typename R, typename... A>
+	struct function_traits<R(*)(A...)> : callable_traits<false, R, A...> { };
+
+	template<typename C, typename R, typename... A>
+	struct function_traits<R(C::*)(A...)> : callable_traits<true, R, C*, A...>
+	{
+		using object_type = C;
+	};
+
+	template<typename C, typename R, typename... A>
+	struct function_traits<R(C::*)(A...) const> : callable_traits<true, R, const C*, A...>
+	{
+		using object_type = C;
+	};
+
+	//returns the index of the first argument that does not convert, or 0
+	template<typename Tuple>
+	struct argument_checker;
+
+	template<typename... A>
+	struct argument_checker<std::tuple<A...>>
+	{
+		static int check(lua_State *L)
+		{
+			return check(L, std::index_sequence_for<A...>());
+		}
+
+		template<size_t... I>
+		static int check(lua_State *L, std::index_sequence<I...>)
+		{
+			(void)L;
+			int bad = 0;
+			int expand[] = { 0, (bad = (bad == 0 && !get_traits<A>::is(L, static_cast<int>(I) + 1)) ? static_cast<int>(I) + 1 : bad)... };
+			(void)expand;
+			return bad;
+		}
+	};
+
+	/*
+		Generates the lua_CFunction for a callable of type F. Empty, trivially
+		copyable callables (such as lambdas without captures) are called through
+		a plain C function without upvalues. Anything else is stored in a full
+		userdata upvalue, with a __gc metamethod if it needs to be destroyed.
+
+		C++ exceptions thrown by the callable are turned into Lua errors.
+	*/
+	template<typename F>
+	class function_binder
+	{
+	public:
+		using traits = function_traits<F>;
+
+		static local bind(state &s, F f);
+		static int dispatch(lua_State *L, F &f);
+
+	private:
+		using arguments = typename traits::argument_types;
+		using sequence = std::make_index_sequence<traits::arity>;
+
+		static const bool stateless = std::is_class<F>::value && std::is_empty<F>::value && std::is_trivially_copyable<F>::value;
+
+		static local bind(state &s, F &f, std::true_type);
+		static local bind(state &s, F &f, std::false_type);
+
+		static F& stateless_instance();
+		static int call_stateless(lua_State *L);
+		static int call_upvalue(lua_State *L);
+		static int gc(lua_State *L);
+
+		static bool check_object(lua_State *L, std::true_type);
+		static bool check_object(lua_State *L, std::false_type);
+		static const char* object_error(lua_State *L, std::true_type);
+		static const char* object_error(lua_State *L, std::false_type);
+		template<size_t... I>
+		static int call(lua_State *L, F &f, std::true_type, std::index_sequence<I...>);
+		template<size_t... I>
+		static int call(lua_State *L, F &f, std::false_type, std::index_sequence<I...>);
+
+		template<typename R>
+		static int push_result(lua_State *L, R &&r);
+		template<typename T>
+		static int push_result(lua_State *L, std::future<T> &&f);
+
+		template<typename G, typename... P>
+		static auto invoke(G &g, P&&... p) -> decltype(g(std::forward<P>(p)...));
+		template<typename M, typename C, typename O, typename... P>
+		static auto invoke(M C::*m, O *obj, P&&... p) -> decltype((obj->*m)(std::forward<P>(p)...));
+	};
+
+	template<typename F>
+	local bind(state &s, F &&f);
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	//binds a function or member function known at compile time, no upvalues needed
+	template<auto F>
+	local bind(state &s);
+#endif
+
+	/*
+		Registers T as a userdata class. Objects are constructed in place inside
+		the userdata block and share one metatable per type, cached in the registry
+		under the address of a static key. Without properties __index is the method
+		table itself, otherwise it is a C closure over precomputed method and getter
+		tables, so no access compares strings in C++.
+
+		Member functions bound with lua::bind and T* arguments only accept userdata
+		carrying T's metatable, so T must be registered on the state first. Light
+		userdata is rejected unless allow_light_userdata was called, since nothing
+		tells what it points to. Scripts cannot reach the metatable, __metatable
+		is set.
+	*/
+	template<typename T>
+	class class_
+	{
+	public:
+		class_(state &s, const char *name);
+
+		template<typename... A>
+		class_& constructor();
+		template<typename F>
+		class_& method(const char *name, F f);
+		template<typename V>
+		class_& property(const char *name, V T::*member, bool writable = true);
+		//lets light userdata pass as a T*, the pointer is trusted blindly
+		class_& allow_light_userdata(bool allow = true);
+
+		template<typename... A>
+		static local create(state &s, A&&... args);
+
+		static bool registered(lua_State *L);
+		static bool is(lua_State *L, int idx);
+		//nullptr if the value is not a T
+		static T* check(lua_State *L, int idx);
+
+	private:
+		state *s;
+		const char *name;
+
+		static char key;
+
+		static bool push_metatable(lua_State *L);
+		void ensure_properties();
+
+		static int gc(lua_State *L);
+		static int index(lua_State *L);
+		static int newindex(lua_State *L);
+		template<typename V>
+		static int get_property(lua_State *L);
+		template<typename V>
+		static int set_property(lua_State *L);
+
+		template<typename... A>
+		static int construct(lua_State *L);
+		template<typename... A, size_t... I>
+		static void construct_at(lua_State *L, void *ud, std::index_sequence<I...>);
+	};
+
+	/*
+		An isolated global environment on an already bootstrapped state, reading through
+		to a snapshot of the globals the constructor takes. reset hands out an empty
+		environment; a table global, package.loaded included, is deep-copied into it when
+		first read, so writes never reach the state or the next environment. pairs over
+		the globals only sees those read or assigned so far. Functions, userdata and
+		metatables stay shared, and the debug library, getmetatable("") and getfenv reach
+		the state's own tables. A sandbox must not outlive its state.
+	*/
+	class sandbox
+	{
+	public:
+		explicit sandbox(state &s);
+		~sandbox();
+
+		sandbox(const sandbox&) = delete;
+		sandbox& operator=(const sandbox&) = delete;
+
+		local load_string(const char *s, const char *name = nullptr);
+		void do_string(const char *s);
+
+		//the environment's globals table
+		local globals();
+		void reset();
+
+	private:
+		state *s;
+		int base, env;
+
+		void load(const char *s, size_t len, const char *name);
+		//replaces the table on top of the stack with its copy, false if it is nested too deeply
+		static bool copy_table(lua_State *L, int memo, int depth);
+		static int index(lua_State *L);
+		static int require(lua_State *L);
+	};
+
+	/*
+		Calls a Lua function that is a pure function of its arguments and remembers the
+		results of the most recently used argument lists, so a repeated call returns
+		without touching Lua. Arguments may be numbers, booleans, strings and interned
+		strings, they are hashed by type and value. Results are kept as locals, so a
+		cached table is shared by every caller that gets it from the cache.
+		A memoized_function must not outlive its state.
+	*/
+	class memoized_function
+	{
+		friend class local;
+
+	public:
+		//the index points into the list, so copies are not allowed, moving keeps both valid
+		memoized_function(const memoized_function&) = delete;
+		memoized_function& operator=(const memoized_function&) = delete;
+		memoized_function(memoized_function&&) = default;
+		memoized_function& operator=(memoized_function&&) = default;
+
+#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
+		template<typename... Args>
+		local operator()(const Args&... args);
+#endif
+
+		size_t size() const;
+		size_t capacity() const;
+		void clear();
+
+	private:
+		struct entry
+		{
+			std::string key;
+			local result;
+		};
+
+		local fn;
+		size_t limit;
+		std::list<entry> entries;
+		std::unordered_map<std::string, std::list<entry>::iterator> index;
+		std::string key;
+
+		memoized_function(const local &fn, size_t capacity);
+
+		void append_keys();
+		template<typename T, typename... Args>
+		void append_keys(const T &arg, const Args&... args);
+
+		void append_key(bool v);
+		template<typename T>
+		typename std::enable_if<std::is_arithmetic<T>::value>::type append_key(T v);
+		void append_key(const char *v);
+		void append_key(const std::string &v);
+#ifdef LUA_WRAPPER_HAS_CPP17
+		void append_key(std::string_view v);
+#endif
+		void append_key(const interned &v);
+		template<typename T>
+		typename std::enable_if<!std::is_arithmetic<T>::value>::type append_key(const T &v);
+
+		void append_bytes(const void *p, size_t n);
+	};
+
+	/*
+		Runs Lua functions as coroutines on one state. A bound function that returns a
+		std::future<T> yields the calling coroutine, which poll resumes with the value
+		once the future is ready (or with nil and the message if it threw). A plain
+		coroutine.yield simply lets the other coroutines run.
+
+		Only one scheduler may be attached to a state at a time and it must be driven
+		from the thread that owns the state.
+	*/
+	class scheduler
+	{
+		template<typename F>
+		friend class function_binder;
+
+	public:
+		explicit scheduler(state &s);
+		~scheduler();
+
+		scheduler(const scheduler&) = delete;
+		scheduler& operator=(const scheduler&) = delete;
+
+		template<typename... Args>
+		void spawn(const local &fn, const Args&... args);
+
+		//resumes every coroutine that can continue, returns how many were resumed
+		size_t poll();
+		//polls until no coroutine is left, blocking on the oldest future when none is ready
+		void run();
+		size_t pending() const;
+
+		//before run blocks, spend up to budget on GC steps of the given size (0 disables this)
+		void set_idle_gc(std::chrono::steady_clock::duration budget, int kilobytes = 0);
+
+#ifdef LUA_WRAPPER_HAS_COROUTINES
+		class awaitable;
+
+		//co_await yields the coroutine's first return value
+		template<typename... Args>
+		awaitable async(const local &fn, const Args&... args);
+#endif
+
+	private:
+		//what a suspended coroutine waits on and how to push the values it is resumed with
+		struct wake
+		{
+			std::function<bool()> ready;
+			std::function<void()> wait;
+			std::function<int(lua_State*)> push;
+		};
+
+		struct completion
+		{
+			bool finished = false;
+			bool failed = false;
+			local result;
+			std::string error;
+#ifdef LUA_WRAPPER_HAS_COROUTINES
+			std::coroutine_handle<> handle;
+#endif
+		};
+
+		struct task
+		{
+			local thread;
+			lua_State *co;
+			wake on;
+			std::shared_ptr<completion> done;
+		};
+
+		//returned by function_binder when the call yielded
+		static const int yielded = -2;
+
+		state *s;
+		std::vector<task> waiting;
+
+		lua_State *current;
+		bool suspended;
+		wake next;
+
+		std::chrono::steady_clock::duration idleBudget;
+		int idleStep;
+
+		template<typename... Args>
+		void start(const local &fn, std::shared_ptr<completion> done, const Args&... args);
+		void resume(task &t, int nargs);
+		void finish(task &t, int status);
+
+		static scheduler* from(lua_State *L);
+		template<typename T>
+		static int suspend(lua_State *L, std::future<T> &&f);
+		template<typename T>
+		static int push_future(lua_State *L, std::future<T> &f);
+		static int push_future(lua_State *L, std::future<void> &f);
+	};
+
+#ifdef LUA_WRAPPER_HAS_COROUTINES
+	class scheduler::awaitable
+	{
+		friend class scheduler;
+
+	public:
+		bool await_ready() const;
+		bool await_suspend(std::coroutine_handle<> h);
+		local await_resume();
+
+	private:
+		std::shared_ptr<completion> c;
+
+		explicit awaitable(std::shared_ptr<completion> c);
+	};
+#endif
+
+#ifdef LUA_WRAPPER_STATE_POOL
+	/*
+		A fixed set of states, each owned by a single worker thread. Jobs submitted from a
+		worker go to the back of its own deque, jobs submitted from elsewhere are spread
+		round robin. Workers take from the back of their own deque and steal from the
+		front of the others when it runs dry.
+
+		NOTE: a job's result must not reference the worker's state, use detach to turn
+		a value type local into a stateless one.
+
+		NOTE: a job that blocks on std::future::get for a job it submitted can deadlock
+		once every worker does the same. Jobs wait through state_pool::wait instead,
+		which keeps running queued jobs on the waiting worker's state in the meantime.
+		wait_idle can not be called from a job.
+	*/
+	class state_pool
+	{
+	public:
+		explicit state_pool(size_t n = 0, const char *bootstrap = nullptr);
+		~state_pool();
+
+		state_pool(const state_pool&) = delete;
+		state_pool& operator=(const state_pool&) = delete;
+
+		template<typename F>
+		auto submit(F &&f) -> std::future<decltype(f(std::declval<state&>()))>;
+		std::future<local> submit(const char *chunk);
+
+		void wait_idle();
+		//like f.get(), but a worker runs queued jobs until f is ready
+		template<typename T>
+		T wait(std::future<T> &f);
+		size_t size() const;
+
+		//the state pinned to the calling thread, nullptr if it is not one of this pool's workers
+		state* this_state();
+
+		static local detach(const local &lcl);
+
+	private:
+		struct worker
+		{
+			std::unique_ptr<state> s;
+			std::deque<std::function<void(state&)>> jobs;
+			std::mutex m;
+			std::thread t;
+		};
+
+		struct worker_id
+		{
+			state_pool *pool;
+			size_t index;
+		};
+
+		std::vector<std::unique_ptr<worker>> workers;
+
+		std::mutex m;
+		std::condition_variable work, idle, progress;
+		size_t queued, running;
+		//only ever increase, a waiter compares them with what it saw before looking for work
+		size_t submitted, finished;
+		size_t next;
+		bool stopping;
+
+		void push(std::function<void(state&)> job);
+		bool take(size_t i, std::function<void(state&)> &job);
+		void execute(size_t i, std::function<void(state&)> &job);
+		void run(size_t i);
+
+		static worker_id& this_worker();
+	};
+#endif
+
+	//nil value
+	const local nil;
+
+	uint64_t little_endian(uint64_t v)
+	{
+		if (native_endianness() == endianness::little)
+			return v;
+
+		uint64_t r = 0;
+		for (size_t i = 0; i < sizeof(v); i++)
+			r = (r << 8) | ((v >> (8 * i)) & 0xff);
+		return r;
+	}
+
+	size_t raw_length(lua_State *L, int idx)
+	{
+#if LUA_VERSION_NUM >= 502
+		return lua_rawlen(L, idx);
+#else
+		return lua_objlen(L, idx);
+#endif
+	}
+
+	/* pool_allocator */
+
+	pool_allocator::cache::cache()
+	{
+		for (block *&b : free)
+			b = nullptr;
+	}
+
+	pool_allocator::chunk_list::~chunk_list()
+	{
+		for (void *c : chunks)
+			std::free(c);
+	}
+
+	void* pool_allocator::reallocate(void *ptr, size_t osize, size_t nsize)
+	{
+		if (ptr == nullptr)
+			osize = 0;
+
+		if (nsize == 0)
+		{
+			if (ptr != nullptr)
+				deallocate(ptr, osize);
+			return nullptr;
+		}
+
+		if (ptr != nullptr)
+		{
+			if (osize > max_pooled && nsize > max_pooled)
+				return std::realloc(ptr, nsize);
+			if (osize <= max_pooled && nsize <= max_pooled && size_class(osize) == size_class(nsize))
+				return ptr;
+		}
+
+		void *p = allocate(nsize);
+		if (p != nullptr && ptr != nullptr)
+		{
+			std::memcpy(p, ptr, osize < nsize ? osize : nsize);
+			deallocate(ptr, osize);
+		}
+		return p;
+	}
+
+	pool_allocator::cache& pool_allocator::local_cache()
+	{
+		thread_local cache c;
+		return c;
+	}
+
+	pool_allocator::chunk_list& pool_allocator::chunks()
+	{
+		//chunks are shared by all threads since blocks may be freed on a different thread
+		static chunk_list c;
+		return c;
+	}
+
+	size_t pool_allocator::size_class(size_t size)
+	{
+		return (size - 1) / granularity;
+	}
+
+	void* pool_allocator::allocate(size_t size)
+	{
+		if (size > max_pooled)
+			return std::malloc(size);
+
+		size_t sc = size_class(size);
+		block *&head = local_cache().free[sc];
+
+		if (head == nullptr)
+		{
+			char *c = reinterpret_cast<char*>(std::malloc(chunk_size));
+			if (c == nullptr)
+				return nullptr;
+
+			{
+				chunk_list &cl = chunks();
+				std::lock_guard<std::mutex> lock(cl.mutex);
+				cl.chunks.push_back(c);
+			}
+
+			size_t bsize = (sc + 1) * granularity;
+			for (size_t off = 0; off + bsize <= chunk_size; off += bsize)
+			{
+				block *b = reinterpret_cast<block*>(c + off);
+				b->next = head;
+				head = b;
+			}
+		}
+
+		block *b = head;
+		head = b->next;
+		return b;
+	}
+
+	void pool_allocator::deallocate(void *p, size_t size)
+	{
+		if (size > max_pooled)
+		{
+			std::free(p);
+			return;
+		}
+
+		block *&head = local_cache().free[size_class(size)];
+		block *b = reinterpret_cast<block*>(p);
+		b->next = head;
+		head = b;
+	}
+
+	/* arena_allocator */
+
+	arena_allocator::arena_allocator(size_t blockSize) : head(nullptr), blockSize(blockSize), last(nullptr)
+	{
+
+	}
+
+	arena_allocator::~arena_allocator()
+	{
+		reset();
+	}
+
+	void* arena_allocator::reallocate(void *ptr, size_t osize, size_t nsize)
+	{
+		if (ptr == nullptr)
+			osize = 0;
+
+		char *p = reinterpret_cast<char*>(ptr);
+
+		if (nsize == 0)
+		{
+			//only the most recent allocation can be given back
+			if (p != nullptr && p == last)
+			{
+				head->used = p - reinterpret_cast<char*>(head);
+				last = nullptr;
+			}
+			return nullptr;
+		}
+
+		if (p != nullptr && nsize <= osize)
+			return p;
+
+		if (p != nullptr && p == last)
+		{
+			size_t offset = p - reinterpret_cast<char*>(head);
+			if (offset + align(nsize) <= head->size)
+			{
+				head->used = offset + align(nsize);
+				return p;
+			}
+		}
+
+		void *np = allocate(nsize);
+		if (np != nullptr && p != nullptr)
+			std::memcpy(np, p, osize);
+		return np;
+	}
+
+	void arena_allocator::reset()
+	{
+		while (head != nullptr)
+		{
+			block *prev = head->prev;
+			std::free(head);
+			head = prev;
+		}
+		last = nullptr;
+	}
+
+	size_t arena_allocator::capacity()
+	{
+		size_t c = 0;
+		for (block *b = head; b != nullptr; b = b->prev)
+			c += b->size;
+		return c;
+	}
+
+	size_t arena_allocator::align(size_t size)
+	{
+		return (size + alignment - 1) & ~(alignment - 1);
+	}
+
+	void* arena_allocator::allocate(size_t size)
+	{
+		size = align(size);
+
+		if (head == nullptr || head->used + size > head->size)
+		{
+			size_t bsize = header_size + size > blockSize ? header_size + size : blockSize;
+			block *b = reinterpret_cast<block*>(std::malloc(bsize));
+			if (b == nullptr)
+				return nullptr;
+			b->prev = head;
+			b->size = bsize;
+			b->used = header_size;
+			head = b;
+		}
+
+		last = reinterpret_cast<char*>(head) + head->used;
+		head->used += size;
+		return last;
+	}
+
+#ifdef LUA_WRAPPER_MAPPED_FILES
+	/* mapped_file */
+
+	mapped_file::mapped_file(const char *path) : view(nullptr), length(0)
+	{
+#ifdef _WIN32
+		HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+		if (file == INVALID_HANDLE_VALUE)
+			throw std::runtime_error(std::string("Unable to open ") + path);
+
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(file, &size))
+		{
+			CloseHandle(file);
+			throw std::runtime_error(std::string("Unable to read the size of ") + path);
+		}
+		length = static_cast<size_t>(size.QuadPart);
+
+		if (length != 0)
+		{
+			//the view keeps the mapping and the file open by itself
+			HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping != nullptr)
+			{
+				view = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+				CloseHandle(mapping);
+			}
+		}
+		CloseHandle(file);
+#else
+		int fd = open(path, O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error(std::string("Unable to open ") + path);
+
+		struct stat st;
+		if (fstat(fd, &st) != 0)
+		{
+			close(fd);
+			throw std::runtime_error(std::string("Unable to read the size of ") + path);
+		}
+		length = static_cast<size_t>(st.st_size);
+
+		if (length != 0)
+		{
+			//the mapping stays valid after the descriptor is closed
+			void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p != MAP_FAILED)
+			{
+				posix_madvise(p, length, POSIX_MADV_SEQUENTIAL);
+				view = static_cast<const char*>(p);
+			}
+		}
+		close(fd);
+#endif
+
+		if (length != 0 && view == nullptr)
+			throw std::runtime_error(std::string("Unable to map ") + path);
+	}
+
+	mapped_file::~mapped_file()
+	{
+		if (view == nullptr)
+			return;
+
+#ifdef _WIN32
+		UnmapViewOfFile(view);
+#else
+		munmap(const_cast<char*>(view), length);
+#endif
+	}
+
+	const char* mapped_file::data() const
+	{
+		return view;
+	}
+
+	size_t mapped_file::size() const
+	{
+		return length;
+	}
+#endif
+
+	/* state */
+
+	state::state() : frame(nullptr)
+	{
+		L = luaL_newstate();
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		//wrap the default allocator so its allocations are counted as well
+		void *ud;
+		lua_Alloc f = lua_getallocf(L, &ud);
+		memory.reset(new memory_context());
+		memory->f = f;
+		memory->ud = ud;
+		memory->bytes = memory->peakBytes = static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+		memory->allocations = memory->limit = 0;
+		lua_setallocf(L, counting_alloc, memory.get());
+#endif
+
+		init();
+	}
+
+	state::state(lua_Alloc f, void *ud) : frame(nullptr)
+	{
+		init_memory(f, ud);
+		init();
+	}
+
+	template<typename A, typename>
+	state::state(A &allocator) : frame(nullptr)
+	{
+		init_memory(policy_alloc<A>, &allocator);
+		init();
+	}
+
+	state::state(state &&s) : L(s.L), frame(s.frame), memory(std::move(s.memory))
+#ifdef LUA_WRAPPER_REF_POOL
+		, poolRef(s.poolRef), poolCapacity(s.poolCapacity), poolNext(s.poolNext),
+		poolFree(std::move(s.poolFree)), poolPending(std::move(s.poolPending)),
+		liveRefs(s.liveRefs), peakRefs(s.peakRefs)
+#endif
+#ifdef LUA_WRAPPER_SHARED_REFS
+		, refCounts(std::move(s.refCounts))
+#endif
+		, interns(std::move(s.interns)), tracebacks(s.tracebacks), errorHandler(s.errorHandler), tracebackPending(s.tracebackPending), gcStopped(s.gcStopped),
+		modules(std::move(s.modules))
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		, ffiRef(s.ffiRef), pointerTypes(std::move(s.pointerTypes))
+#endif
+#ifdef LUA_WRAPPER_CHUNK_CACHE
+		, chunkEntries(std::move(s.chunkEntries)), chunkCache(std::move(s.chunkCache)), chunkCapacity(s.chunkCapacity)
+#endif
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		, counters(s.counters), profiling(s.profiling), lastSample(s.lastSample), samples(std::move(s.samples))
+#endif
+	{
+		if (L != nullptr)
+			register_owner();
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		if (profiling)
+			register_profiler();
+		s.profiling = false;
+#endif
+		s.L = nullptr;
+		s.frame = nullptr;
+	}
+
+	state::~state()
+	{
+		if (L != nullptr)
+			lua_close(L);
+	}
+
+	void state::init()
+	{
+		register_owner();
+#ifdef LUA_WRAPPER_REF_POOL
+		init_ref_pool();
+#endif
+	}
+
+	void state::init_memory(lua_Alloc f, void *ud)
+	{
+		memory.reset(new memory_context());
+		memory->f = f;
+		memory->ud = ud;
+		memory->bytes = memory->peakBytes = memory->allocations = memory->limit = 0;
+
+		L = lua_newstate(counting_alloc, memory.get());
+		if (L == nullptr)
+			throw std::runtime_error("Unable to create a Lua state with a custom allocator");
+	}
+
+	void* state::counting_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+	{
+		memory_context *m = static_cast<memory_context*>(ud);
+
+		//when ptr is null osize may hold a type tag instead of a size
+		if (ptr == nullptr)
+			osize = 0;
+
+		if (nsize > osize && m->limit != 0 && m->bytes - osize + nsize > m->limit)
+			return nullptr;
+
+		void *p = m->f(m->ud, ptr, osize, nsize);
+		if (p == nullptr && nsize != 0)
+			return nullptr;
+
+		m->bytes = m->bytes - osize + nsize;
+		if (m->bytes > m->peakBytes)
+			m->peakBytes = m->bytes;
+		if (ptr == nullptr)
+			m->allocations++;
+
+		return p;
+	}
+
+	template<typename A>
+	void* state::policy_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+	{
+		return static_cast<A*>(ud)->reallocate(ptr, osize, nsize);
+	}
+
+	size_t state::allocated_bytes()
+	{
+		if (memory)
+			return memory->bytes;
+
+		return static_cast<size_t>(lua_gc(L, LUA_GCCOUNT, 0)) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+	}
+
+	size_t state::peak_allocated_bytes()
+	{
+		if (memory)
+			return memory->peakBytes;
+
+		return allocated_bytes();
+	}
+
+	size_t state::allocation_count()
+	{
+		if (memory)
+			return memory->allocations;
+
+		return 0;
+	}
+
+	void state::set_memory_limit(size_t bytes)
+	{
+		//allocations that would exceed the limit fail with a Lua memory error
+		if (!memory)
+			throw std::logic_error("A memory limit requires a state created with an allocator");
+		memory->limit = bytes;
+	}
+
+	void state::gc_collect()
+	{
+		gc_control(LUA_GCCOLLECT, 0);
+	}
+
+	bool state::gc_step(int kilobytes)
+	{
+		return gc_control(LUA_GCSTEP, kilobytes) != 0;
+	}
+
+	bool state::gc_idle(std::chrono::steady_clock::duration budget, int kilobytes)
+	{
+		auto end = std::chrono::steady_clock::now() + budget;
+		do
+		{
+			if (gc_step(kilobytes))
+				return true;
+		} while (std::chrono::steady_clock::now() < end);
+
+		return false;
+	}
+
+	void state::gc_stop()
+	{
+		lua_gc(L, LUA_GCSTOP, 0);
+		gcStopped = true;
+	}
+
+	void state::gc_restart()
+	{
+		lua_gc(L, LUA_GCRESTART, 0);
+		gcStopped = false;
+	}
+
+	bool state::gc_running()
+	{
+#ifdef LUA_GCISRUNNING
+		return lua_gc(L, LUA_GCISRUNNING, 0) != 0;
+#else
+		return !gcStopped;
+#endif
+	}
+
+	int state::gc_set_pause(int percent)
+	{
+		return lua_gc(L, LUA_GCSETPAUSE, percent);
+	}
+
+	int state::gc_set_step_multiplier(int percent)
+	{
+		return lua_gc(L, LUA_GCSETSTEPMUL, percent);
+	}
+
+#ifdef LUA_GCGEN
+	void state::gc_generational(int minorMultiplier, int majorMultiplier)
+	{
+		lua_gc(L, LUA_GCGEN, minorMultiplier, majorMultiplier);
+	}
+
+	void state::gc_incremental(int pause, int stepMultiplier, int stepSize)
+	{
+		lua_gc(L, LUA_GCINC, pause, stepMultiplier, stepSize);
+	}
+#endif
+
+	int state::gc_control(int what, int data)
+	{
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		auto start = std::chrono::steady_clock::now();
+#endif
+
+		//Lua 5.1 and LuaJIT rearm the collector's threshold when stepping, undoing gc_stop
+		bool stopped = !gc_running();
+		int r = lua_gc(L, what, data);
+		if (stopped)
+			lua_gc(L, LUA_GCSTOP, 0);
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		counters.gcSteps++;
+		counters.gcSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+#endif
+		return r;
+	}
+
+	state::operator lua_State*()
+	{
+		return L;
+	}
+
+	char state::ownerKey;
+
+	state* state::owner(lua_State *L)
+	{
+		state *s = find_owner(L);
+		if (s == nullptr)
+			throw std::logic_error("lua_State is not owned by a lua::state");
+		return s;
+	}
+
+	state* state::find_owner(lua_State *L)
+	{
+		lua_pushlightuserdata(L, &ownerKey);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		state *s = static_cast<state*>(lua_touserdata(L, -1));
+		lua_pop(L, 1);
+		return s;
+	}
+
+	void state::register_owner()
+	{
+		lua_pushlightuserdata(L, &ownerKey);
+		lua_pushlightuserdata(L, this);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+
+	local state::get_argument(lua_State *from, int idx)
+	{
+		lua_pushvalue(from, idx);
+		if (from != L)
+			lua_xmove(from, L, 1);
+
+		frame_suspension suspended(this);
+		local lcl(*this);
+		try
+		{
+			lcl.load_value(-1);
+		}
+		catch (...)
+		{
+			lua_pop(L, 1);
+			throw;
+		}
+		lua_pop(L, 1);
+		return lcl;
+	}
+
+	state::frame_suspension::frame_suspension(state *s) : s(s), frame(s != nullptr ? s->frame : nullptr)
+	{
+		if (s != nullptr)
+			s->frame = nullptr;
+	}
+
+	state::frame_suspension::~frame_suspension()
+	{
+		if (s != nullptr)
+			s->frame = frame;
+	}
+
+	local get_traits<local>::get(lua_State *L, int idx)
+	{
+		return state::owner(L)->get_argument(L, idx);
+	}
+
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+	local state::share(void *data, const char *ctype)
+	{
+		stack_guard guard(*this, 3);
+		push_ffi("cast");
+		push_pointer_type(ctype);
+		lua_pushlightuserdata(L, data);
+		if (protected_call(2, 1))
+			raise_error();
+
+		local lcl(*this);
+		lcl.load_value(-1);
+		return lcl;
+	}
+
+	template<typename T>
+	local state::share(std::shared_ptr<T> owner, const char *ctype)
+	{
+		local cdata = share(const_cast<void*>(static_cast<const void*>(owner.get())), ctype);
+
+		stack_guard guard(*this, 6);
+		push_ffi("gc");
+		cdata.push_value(L);
+
+		//the finalizer drops the owner as soon as the cdata is collected
+		void *ud = lua_newuserdata(L, sizeof(std::shared_ptr<T>));
+		new (ud) std::shared_ptr<T>(std::move(owner));
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&destroy_owner<T>));
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		if (lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 1);
+			lua_pushcfunction(L, &destroy_owner<T>);
+			lua_setfield(L, -2, "__gc");
+			lua_pushlightuserdata(L, reinterpret_cast<void*>(&destroy_owner<T>));
+			lua_pushvalue(L, -2);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+		}
+		lua_setmetatable(L, -2);
+		lua_pushcclosure(L, &release_owner<T>, 1);
+
+		if (protected_call(2, 0))
+			raise_error();
+		return cdata;
+	}
+
+#ifdef LUA_WRAPPER_HAS_SPAN
+	template<typename T>
+	local state::share(std::span<T> data, const char *ctype)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be shared with the FFI");
+		return share(const_cast<void*>(static_cast<const void*>(data.data())), ctype);
+	}
+#endif
+
+	template<typename T>
+	T* state::cdata_pointer(const local &cdata)
+	{
+		return *static_cast<T* const*>(cdata_address(cdata));
+	}
+
+	template<typename T>
+	T* state::cdata_payload(const local &cdata, size_t *count)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Only trivially copyable types can be read from cdata");
+		T *p = static_cast<T*>(const_cast<void*>(cdata_address(cdata)));
+
+		if (count != nullptr)
+		{
+			stack_guard guard(*this, 2);
+			push_ffi("sizeof");
+			cdata.push_value(L);
+			if (protected_call(1, 1))
+				raise_error();
+			*count = static_cast<size_t>(lua_tonumber(L, -1)) / sizeof(T);
+		}
+		return p;
+	}
+
+#ifdef LUA_WRAPPER_HAS_SPAN
+	template<typename T>
+	std::span<T> state::cdata_span(const local &array)
+	{
+		size_t n;
+		T *p = cdata_payload<T>(array, &n);
+		return std::span<T>(p, n);
+	}
+#endif
+
+	void state::push_ffi(const char *name)
+	{
+		if (ffiRef == LUA_NOREF)
+		{
+			//luaL_openlibs only preloads ffi, requiring it once puts it in package.loaded
+			lua_getglobal(L, "require");
+			if (!lua_isfunction(L, -1))
+			{
+				lua_pop(L, 1);
+				throw std::logic_error("Loading the ffi library requires require");
+			}
+			lua_pushstring(L, LUA_FFILIBNAME);
+			if (protected_call(1, 1))
+				raise_error();
+			ffiRef = luaL_ref(L, LUA_REGISTRYINDEX);
+			LUA_WRAPPER_COUNT(counters.refs);
+		}
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ffiRef);
+		lua_getfield(L, -1, name);
+		lua_remove(L, -2);
+	}
+
+	void state::push_pointer_type(const char *ctype)
+	{
+		auto it = pointerTypes.find(ctype);
+		if (it != pointerTypes.end())
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, it->second);
+			return;
+		}
+
+		push_ffi("typeof");
+		lua_pushfstring(L, "%s*", ctype);
+		if (protected_call(1, 1))
+			raise_error();
+		lua_pushvalue(L, -1);
+		pointerTypes.emplace(ctype, luaL_ref(L, LUA_REGISTRYINDEX));
+		LUA_WRAPPER_COUNT(counters.refs);
+	}
+
+	const void* state::cdata_address(const local &cdata)
+	{
+		cdata.check_state_consistancy(L);
+		if (cdata.t != local::type::cdata)
+			throw std::logic_error("Expected a cdata local");
+
+		//for cdata lua_topointer gives the address of the payload
+		cdata.push_value(L);
+		const void *p = lua_topointer(L, -1);
+		lua_pop(L, 1);
+		return p;
+	}
+
+	template<typename T>
+	int state::release_owner(lua_State *L)
+	{
+		static_cast<std::shared_ptr<T>*>(lua_touserdata(L, lua_upvalueindex(1)))->reset();
+		return 0;
+	}
+
+	template<typename T>
+	int state::destroy_owner(lua_State *L)
+	{
+		static_cast<std::shared_ptr<T>*>(lua_touserdata(L, 1))->~shared_ptr();
+		return 0;
+	}
+#endif
+
+	void state::open_libs()
+	{
+		luaL_openlibs(L);
+	}
+
+	void state::open_libs(unsigned int mask)
+	{
+		struct library
+		{
+			unsigned int flag;
+			const char *name;
+			lua_CFunction open;
+		};
+
+		static const library libraries[] =
+		{
+#if LUA_VERSION_NUM >= 502
+			{ libs::base, "_G", luaopen_base },
+#else
+			{ libs::base, "", luaopen_base },
+#endif
+			{ libs::package, LUA_LOADLIBNAME, luaopen_package },
+#if LUA_VERSION_NUM >= 502
+			{ libs::coroutine, LUA_COLIBNAME, luaopen_coroutine },
+#endif
+			{ libs::table, LUA_TABLIBNAME, luaopen_table },
+			{ libs::io, LUA_IOLIBNAME, luaopen_io },
+			{ libs::os, LUA_OSLIBNAME, luaopen_os },
+			{ libs::string, LUA_STRLIBNAME, luaopen_string },
+			{ libs::math, LUA_MATHLIBNAME, luaopen_math },
+#ifdef LUA_UTF8LIBNAME
+			{ libs::utf8, LUA_UTF8LIBNAME, luaopen_utf8 },
+#endif
+			{ libs::debug, LUA_DBLIBNAME, luaopen_debug },
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+			{ libs::bit, LUA_BITLIBNAME, luaopen_bit },
+			{ libs::jit, LUA_JITLIBNAME, luaopen_jit },
+#endif
+		};
+
+		for (const library &lib : libraries)
+			if ((mask & lib.flag) != 0)
+				open_library(lib.name, lib.open);
+
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		if ((mask & libs::ffi) != 0)
+		{
+			if ((mask & libs::package) != 0)
+				preload(LUA_FFILIBNAME, luaopen_ffi);
+			else
+			{
+				open_library(LUA_FFILIBNAME, luaopen_ffi);
+				lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+				lua_getfield(L, -1, LUA_FFILIBNAME);
+				lua_setglobal(L, LUA_FFILIBNAME);
+				lua_pop(L, 1);
+			}
+		}
+#endif
+	}
+
+	void state::open_library(const char *name, lua_CFunction open)
+	{
+#if LUA_VERSION_NUM >= 502
+		luaL_requiref(L, name, open, 1);
+		lua_pop(L, 1);
+#else
+		lua_pushcfunction(L, open);
+		lua_pushstring(L, name);
+		lua_call(L, 1, 0);
+#endif
+	}
+
+	void state::preload(const char *name, lua_CFunction open)
+	{
+		push_preload();
+		lua_pushcfunction(L, open);
+		lua_setfield(L, -2, name);
+		lua_pop(L, 1);
+	}
+
+	void state::preload(const char *name, std::function<local(state&)> build)
+	{
+		push_preload();
+		modules[name] = std::move(build);
+		lua_pushstring(L, name);
+		lua_pushcclosure(L, &load_module, 1);
+		lua_setfield(L, -2, name);
+		lua_pop(L, 1);
+	}
+
+	void state::push_preload()
+	{
+		push_globals();
+		lua_getfield(L, -1, LUA_LOADLIBNAME);
+		if (!lua_istable(L, -1))
+		{
+			lua_pop(L, 2);
+			throw std::logic_error("Preloading a module requires the package library");
+		}
+		lua_getfield(L, -1, "preload");
+		lua_remove(L, -2);
+		lua_remove(L, -2);
+	}
+
+	int state::load_module(lua_State *L)
+	{
+		//looked up on every call, a pointer captured at preload time would dangle once the state is moved
+		state *s = find_owner(L);
+		if (s == nullptr)
+			return luaL_error(L, "Module loader called on a lua_State without its lua::state");
+		const char *name = lua_tostring(L, lua_upvalueindex(1));
+
+		bool failed = false;
+		{
+			//the builder runs on this call's stack
+			frame_suspension suspended(s);
+			try
+			{
+				local module = s->modules.at(name)(*s);
+				module.push_value(L);
+			}
+			catch (const std::exception &e)
+			{
+				lua_pushstring(L, e.what());
+				failed = true;
+			}
+			catch (...)
+			{
+				lua_pushstring(L, "Unknown C++ exception");
+				failed = true;
+			}
+		}
+
+		if (failed)
+			return lua_error(L);
+
+		return 1;
+	}
+
+	void state::do_string(const char *n)
+	{
+#ifdef LUA_WRAPPER_CHUNK_CACHE
+		push_chunk(n, std::strlen(n), n);
+#else
+		LUA_WRAPPER_COUNT(counters.compiles);
+		if (luaL_loadstring(L, n))
+			raise_error();
+#endif
+		if (protected_call(0, 0))
+			raise_error();
+	}
+
+	void state::set_traceback(bool enabled)
+	{
+		if (enabled && errorHandler == LUA_NOREF)
+		{
+			lua_pushcfunction(L, &traceback_handler);
+			errorHandler = luaL_ref(L, LUA_REGISTRYINDEX);
+			LUA_WRAPPER_COUNT(counters.refs);
+		}
+		tracebacks = enabled;
+	}
+
+	int state::protected_call(int nargs, int nresults, bool traceback)
+	{
+		LUA_WRAPPER_COUNT(counters.calls);
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		//time spent in C++ since the last sample is not charged to a script function
+		if (profiling)
+			lastSample = std::chrono::steady_clock::now();
+#endif
+
+		//a failure nobody raised must not lend its traceback to this call
+		if (tracebackPending)
+			clear_traceback();
+
+		int status;
+		if (!tracebacks || !traceback)
+			status = lua_pcall(L, nargs, nresults, 0);
+		else
+		{
+			int fn = lua_gettop(L) - nargs;
+			lua_rawgeti(L, LUA_REGISTRYINDEX, errorHandler);
+			lua_insert(L, fn);
+			status = lua_pcall(L, nargs, nresults, fn);
+			lua_remove(L, fn);
+			tracebackPending = status != 0;
+		}
+
+		if (status != 0)
+			LUA_WRAPPER_COUNT(counters.errors);
+		return status;
+	}
+
+	local state::pop_error()
+	{
+		//errors outlive any stack_frame, so the value always goes to the registry
+		stack_frame *f = frame;
+		frame = nullptr;
+		local value(*this);
+		value.load_value(-1);
+		frame = f;
+		lua_pop(L, 1);
+		return value;
+	}
+
+	local state::take_traceback()
+	{
+		if (!tracebackPending)
+			return local();
+
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&traceback_handler));
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		local tb = pop_error();
+		clear_traceback();
+		return tb;
+	}
+
+	void state::clear_traceback()
+	{
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&traceback_handler));
+		lua_pushnil(L);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		tracebackPending = false;
+	}
+
+	void state::raise_error()
+	{
+		local tb = take_traceback();
+		throw error(pop_error(), tb);
+	}
+
+	int state::traceback_handler(lua_State *L)
+	{
+		//the error value is passed through untouched, the traceback goes to the registry
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&traceback_handler));
+		luaL_traceback(L, L, nullptr, 1);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		lua_settop(L, 1);
+		return 1;
+	}
+
+	local state::load_string(const char *s, const char *name)
+	{
+		push_chunk(s, std::strlen(s), name != nullptr ? name : s);
+		local lcl(*this);
+		push_function_local(lcl);
+		return lcl;
+	}
+
+	local state::load_file(const char *path)
+	{
+		LUA_WRAPPER_COUNT(counters.compiles);
+		if (luaL_loadfile(L, path))
+			raise_error();
+
+		local lcl(*this);
+		push_function_local(lcl);
+		return lcl;
+	}
+
+	local state::load_bytecode(const char *data, size_t len, const char *name)
+	{
+		LUA_WRAPPER_COUNT(counters.compiles);
+		if (luaL_loadbuffer(L, data, len, name))
+			raise_error();
+
+		local lcl(*this);
+		push_function_local(lcl);
+		return lcl;
+	}
+
+#ifdef LUA_WRAPPER_MAPPED_FILES
+	local state::load_file_mmap(const char *path)
+	{
+		mapped_file file(path);
+		const char *data = file.size() != 0 ? file.data() : "";
+		size_t len = file.size();
+
+		//like luaL_loadfile a leading # line is skipped, its newline is kept so line numbers match
+		if (len != 0 && data[0] == '#')
+		{
+			const char *nl = static_cast<const char*>(std::memchr(data, '\n', len));
+			size_t skip = nl != nullptr ? static_cast<size_t>(nl - data) : len;
+			if (skip + 1 < len && data[skip + 1] == LUA_SIGNATURE[0])
+				skip++;
+			data += skip;
+			len -= skip;
+		}
+
+		std::string name = std::string("@") + path;
+		LUA_WRAPPER_COUNT(counters.compiles);
+		if (luaL_loadbuffer(L, data, len, name.c_str()))
+			raise_error();
+
+		local lcl(*this);
+		push_function_local(lcl);
+		return lcl;
+	}
+#endif
+
+	template<typename F>
+	local state::load(F &&reader, const char *name)
+	{
+		using reader_type = typename std::remove_reference<F>::type;
+		stream_reader<reader_type> r = { &reader, nullptr };
+
+		LUA_WRAPPER_COUNT(counters.compiles);
+		int status = load_stream(&read_stream<reader_type>, &r, name);
+		if (r.error)
+		{
+			//whatever lua_load made of the truncated input is dropped
+			lua_pop(L, 1);
+			std::rethrow_exception(r.error);
+		}
+		if (status != 0)
+			raise_error();
+
+		local lcl(*this);
+		push_function_local(lcl);
+		return lcl;
+	}
+
+	template<typename F>
+	const char* state::read_stream(lua_State *, void *ud, size_t *size)
+	{
+		//exceptions must not unwind through lua_load
+		stream_reader<F> *r = static_cast<stream_reader<F>*>(ud);
+		try
+		{
+			const char *p = (*r->reader)(*size);
+			if (p == nullptr)
+				*size = 0;
+			return p;
+		}
+		catch (...)
+		{
+			r->error = std::current_exception();
+			*size = 0;
+			return nullptr;
+		}
+	}
+
+	int state::load_stream(lua_Reader reader, void *ud, const char *name)
+	{
+#if LUA_VERSION_NUM >= 502
+		return lua_load(L, reader, ud, name, nullptr);
+#else
+		return lua_load(L, reader, ud, name);
+#endif
+	}
+
+	std::string state::dump(const local &fn)
+	{
+		if (fn.t != local::type::function)
+			throw std::logic_error("Cannot dump a local that is not a Lua function");
+		fn.check_state_consistancy(L);
+
+		std::string bc;
+		fn.push_ref_value();
+		dump_top(bc);
+
+		return bc;
+	}
+
+	void state::dump_top(std::string &bc)
+	{
+		//pops the function on top of the stack
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		int err = lua_dump(L, dump_writer, &bc);
+#else
+		int err = lua_dump(L, dump_writer, &bc, 0);
+#endif
+		lua_pop(L, 1);
+
+		if (err)
+			throw std::runtime_error("Unable to dump function");
+	}
+
+	void state::push_chunk(const char *s, size_t len, const char *name)
+	{
+#ifdef LUA_WRAPPER_CHUNK_CACHE
+		uint64_t h = hash_chunk(s, len);
+		auto it = find_cached_chunk(h, s, len);
+		if (it != chunkEntries.end())
+		{
+			chunkEntries.splice(chunkEntries.begin(), chunkEntries, it);
+			push_ref(it->ref);
+			return;
+		}
+#endif
+
+		LUA_WRAPPER_COUNT(counters.compiles);
+		if (luaL_loadbuffer(L, s, len, name))
+			raise_error();
+
+#ifdef LUA_WRAPPER_CHUNK_CACHE
+		add_cached_chunk(h, s, len, name);
+#endif
+	}
+
+	void state::push_function_local(local &lcl)
+	{
+		//takes ownership of the function on top of the stack
+		lcl.t = local::type::function;
+		lcl.load_ref_value_no_type();
+		lua_pop(L, 1);
+	}
+
+	int state::dump_writer(lua_State *, const void *p, size_t sz, void *ud)
+	{
+		static_cast<std::string*>(ud)->append(static_cast<const char*>(p), sz);
+		return 0;
+	}
+
+#ifdef LUA_WRAPPER_CHUNK_CACHE
+	uint64_t state::hash_chunk(const char *s, size_t len)
+	{
+		//FNV-1a
+		uint64_t h = 14695981039346656037ull;
+		for (size_t i = 0; i < len; i++)
+		{
+			h ^= static_cast<unsigned char>(s[i]);
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	state::chunk_list::iterator state::find_cached_chunk(uint64_t h, const char *s, size_t len)
+	{
+		auto range = chunkCache.equal_range(h);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			const std::string &src = it->second->source;
+			if (src.size() == len && std::memcmp(src.data(), s, len) == 0)
+				return it->second;
+		}
+		return chunkEntries.end();
+	}
+
+	void state::add_cached_chunk(uint64_t h, const char *s, size_t len, const char *name)
+	{
+		//expects the compiled chunk on top of the stack and leaves it there
+		if (chunkCapacity == 0)
+			return;
+		evict_chunks(chunkCapacity - 1);
+
+		lua_pushvalue(L, -1);
+		cached_chunk c;
+		c.hash = h;
+		c.source.assign(s, len);
+		c.name = name;
+		c.ref = ref();
+		chunkEntries.push_front(std::move(c));
+		chunkCache.emplace(h, chunkEntries.begin());
+	}
+
+	void state::evict_chunks(size_t keep)
+	{
+		while (chunkEntries.size() > keep)
+		{
+			auto last = std::prev(chunkEntries.end());
+			auto range = chunkCache.equal_range(last->hash);
+			for (auto it = range.first; it != range.second; ++it)
+			{
+				if (it->second == last)
+				{
+					chunkCache.erase(it);
+					break;
+				}
+			}
+			unref(last->ref);
+			chunkEntries.pop_back();
+		}
+	}
+
+	/*
+		Layout: the number of chunks followed by, for each chunk, its source,
+		its name and its bytecode, each preceded by its length. Every integer
+		is a little endian uint64_t. The bytecode itself is only portable between
+		processes using the same Lua implementation on the same platform.
+	*/
+	std::string state::save_chunk_cache()
+	{
+		std::string out;
+		auto put = [&out](uint64_t v) { v = little_endian(v); out.append(reinterpret_cast<const char*>(&v), sizeof(v)); };
+		auto put_str = [&out, &put](const std::string &str) { put(str.size()); out.append(str); };
+
+		//least recently used first, loading the cache then restores the same order
+		put(chunkEntries.size());
+		for (auto e = chunkEntries.rbegin(); e != chunkEntries.rend(); ++e)
+		{
+			put_str(e->source);
+			put_str(e->name);
+
+			std::string bc;
+			push_ref(e->ref);
+			dump_top(bc);
+			put_str(bc);
+		}
+
+		return out;
+	}
+
+	void state::load_chunk_cache(const std::string &data)
+	{
+		size_t pos = 0;
+		auto get = [&data, &pos]() -> uint64_t
+		{
+			uint64_t v;
+			if (data.size() - pos < sizeof(v))
+				throw std::runtime_error("Truncated chunk cache");
+			std::memcpy(&v, data.data() + pos, sizeof(v));
+			pos += sizeof(v);
+			return little_endian(v);
+		};
+		auto get_str = [&data, &pos, &get]() -> std::string
+		{
+			uint64_t len = get();
+			if (data.size() - pos < len)
+				throw std::runtime_error("Truncated chunk cache");
+			std::string str(data, pos, static_cast<size_t>(len));
+			pos += static_cast<size_t>(len);
+			return str;
+		};
+
+		uint64_t count = get();
+		for (uint64_t i = 0; i < count; i++)
+		{
+			std::string source = get_str();
+			std::string name = get_str();
+			std::string bc = get_str();
+
+			uint64_t h = hash_chunk(source.data(), source.size());
+			if (find_cached_chunk(h, source.data(), source.size()) != chunkEntries.end())
+				continue;
+
+			LUA_WRAPPER_COUNT(counters.compiles);
+			if (luaL_loadbuffer(L, bc.data(), bc.size(), name.c_str()))
+				raise_error();
+
+			add_cached_chunk(h, source.data(), source.size(), name.c_str());
+			lua_pop(L, 1);
+		}
+	}
+
+	void state::clear_chunk_cache()
+	{
+		evict_chunks(0);
+	}
+
+	size_t state::chunk_cache_size()
+	{
+		return chunkEntries.size();
+	}
+
+	void state::set_chunk_cache_capacity(size_t n)
+	{
+		chunkCapacity = n;
+		evict_chunks(n);
+	}
+
+	size_t state::chunk_cache_capacity()
+	{
+		return chunkCapacity;
+	}
+#endif
+
+	local state::create_table(int narr, int nrec)
+	{
+		lua_createtable(L, narr, nrec);
+
+		local lcl(*this);
+		lcl.t = local::type::table;
+		lcl.load_ref_value_no_type();
+		lua_pop(L, 1);
+
+		return lcl;
+	}
+
+	template<typename T>
+	local state::create_table_from(const T *data, size_t n)
+	{
+		lua_createtable(L, static_cast<int>(n), 0);
+		for (size_t i = 0; i < n; i++)
+		{
+			push_traits<T>::push(L, data[i]);
+			lua_rawseti(L, -2, static_cast<int>(i + 1));
+		}
+
+		local lcl(*this);
+		lcl.t = local::type::table;
+		lcl.load_ref_value_no_type();
+		lua_pop(L, 1);
+
+		return lcl;
+	}
+
+	template<typename C>
+	local state::create_table_from(const C &c)
+	{
+		lua_createtable(L, static_cast<int>(c.size()), 0);
+		int i = 0;
+		for (const auto &v : c)
+		{
+			push_traits<typename std::decay<decltype(v)>::type>::push(L, v);
+			lua_rawseti(L, -2, ++i);
+		}
+
+		local lcl(*this);
+		lcl.t = local::type::table;
+		lcl.load_ref_value_no_type();
+		lua_pop(L, 1);
+
+		return lcl;
+	}
+
+	local state::create_thread(const local &fn)
+	{
+		fn.check_state_consistancy(L);
+		lua_State *co = lua_newthread(L);
+		fn.push_value(L);
+		lua_xmove(L, co, 1);
+
+		local lcl(*this);
+		lcl.load_value();
+		lua_pop(L, 1);
+		return lcl;
+	}
+
+	local state::create_string(const char *s)
+	{
+		local lcl(*this);
+		lcl.set_as_string(s);
+		return lcl;
+	}
+
+	local state::create_string(const char *s, size_t len)
+	{
+		local lcl(*this);
+		lcl.set_as_string(s, len);
+		return lcl;
+	}
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	local state::create_string(std::string_view s)
+	{
+		return create_string(s.data(), s.size());
+	}
+#endif
+
+	local state::get_global(const char *n)
+	{
+		lua_getglobal(L, n);
+		local lcl(*this);
+		lcl.load_value();
+		lua_pop(L, 1);
+		return lcl;
+	}
+
+	void state::set_global(const local &lcl, const char *n)
+	{
+		lcl.check_state_consistancy(L);
+		lcl.push_value(L);
+		lua_setglobal(L, n);
+	}
+
+	template<typename K, typename... T>
+	void state::get_globals(std::initializer_list<K> names, T&... out)
+	{
+		check_fields(names.size(), sizeof...(T), static_cast<int>(sizeof...(T)) + 1);
+		push_globals();
+		get_fields_at(lua_gettop(L), names, out...);
+		lua_pop(L, 1);
+	}
+
+	template<typename K, typename... T>
+	void state::set_globals(std::initializer_list<K> names, const T&... values)
+	{
+		check_fields(names.size(), sizeof...(T), 3);
+		push_globals();
+		set_fields_at(lua_gettop(L), names, values...);
+		lua_pop(L, 1);
+	}
+
+	template<typename T>
+	T state::get_value(int idx)
+	{
+		return get_traits<T>::get(L, idx);
+	}
+
+	template<>
+	local state::get_value<local>(int idx)
+	{
+		local lcl(*this);
+		lcl.load_value(idx);
+		return lcl;
+	}
+
+	template<typename... T>
+	void state::pop_values(T&... out)
+	{
+		static_assert(!borrows_stack<T...>::value, "Values are popped before they are returned, read strings as std::string or lua::local");
+
+		//negative indices stay valid if a stack_frame inserts slots beneath the values
+		const int n = static_cast<int>(sizeof...(T));
+		int idx = -n;
+		int expand[] = { 0, (out = get_value<T>(idx++), 0)... };
+		(void)expand;
+		lua_pop(L, n);
+	}
+
+	void state::check_fields(size_t keys, size_t values, int slots)
+	{
+		//checked before anything is pushed so throwing leaves the stack alone
+		if (keys != values)
+			throw std::logic_error("Number of keys does not match the number of values");
+		if (!lua_checkstack(L, slots))
+			throw std::runtime_error("Not enough stack space for the fields");
+	}
+
+	template<typename K, typename... T>
+	void state::get_fields_at(int tbl, std::initializer_list<K> keys, T&... out)
+	{
+		for (const K &k : keys)
+		{
+			push_traits<K>::push(L, k);
+			lua_gettable(L, tbl);
+		}
+		pop_values(out...);
+	}
+
+	template<typename K, typename... T>
+	void state::set_fields_at(int tbl, std::initializer_list<K> keys, const T&... values)
+	{
+		const K *k = keys.begin();
+		int expand[] = { 0, (push_traits<K>::push(L, *k++), push_traits<T>::push(L, values), lua_settable(L, tbl), 0)... };
+		(void)expand;
+	}
+
+	local state::get_global(const interned &n)
+	{
+		if (n.L != L)
+			throw std::logic_error("Inconsistant state between interned string and state");
+		push_globals();
+		n.push(L);
+		lua_gettable(L, -2);
+		local lcl(*this);
+		lcl.load_value();
+		lua_pop(L, 2);
+		return lcl;
+	}
+
+	void state::set_global(const local &lcl, const interned &n)
+	{
+		if (n.L != L)
+			throw std::logic_error("Inconsistant state between interned string and state");
+		lcl.check_state_consistancy(L);
+		push_globals();
+		n.push(L);
+		lcl.push_value(L);
+		lua_settable(L, -3);
+		lua_pop(L, 1);
+	}
+
+	interned state::intern(const char *s)
+	{
+		auto it = interns.find(s);
+		if (it != interns.end())
+			return interned(L, it->second);
+
+		//pinned directly in the registry so pushing it is always a single lua_rawgeti
+		lua_pushstring(L, s);
+		int r = luaL_ref(L, LUA_REGISTRYINDEX);
+		LUA_WRAPPER_COUNT(counters.refs);
+		interns.emplace(s, r);
+		return interned(L, r);
+	}
+
+	void state::push_globals()
+	{
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		lua_pushvalue(L, LUA_GLOBALSINDEX);
+#else
+		lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+#endif
+	}
+
+	int state::ref()
+	{
+		int r;
+		LUA_WRAPPER_COUNT(counters.refs);
+
+#ifdef LUA_WRAPPER_REF_POOL
+		if (!poolFree.empty())
+		{
+			r = poolFree.back();
+			poolFree.pop_back();
+		}
+		else if (!poolPending.empty())
+		{
+			//the slot is overwritten below, no need to clear it first
+			r = poolPending.back();
+			poolPending.pop_back();
+		}
+		else
+		{
+			r = ++poolNext;
+			if (r > poolCapacity)
+				poolCapacity = r;
+		}
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, poolRef);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, r);
+		lua_pop(L, 1);
+
+		if (++liveRefs > peakRefs)
+			peakRefs = liveRefs;
+#else
+		r = luaL_ref(L, LUA_REGISTRYINDEX);
+#endif
+
+#ifdef LUA_WRAPPER_SHARED_REFS
+		if (r > 0)
+		{
+			if (static_cast<size_t>(r) >= refCounts.size())
+				refCounts.resize(r + 1);
+			refCounts[r] = 1;
+		}
+#endif
+
+		return r;
+	}
+
+	int state::share_ref(int r)
+	{
+#ifdef LUA_WRAPPER_SHARED_REFS
+		if (r > 0)
+			refCounts[r]++;
+		return r;
+#else
+		push_ref(r);
+		return ref();
+#endif
+	}
+
+	void state::unref(int r)
+	{
+#ifdef LUA_WRAPPER_SHARED_REFS
+		if (r > 0 && --refCounts[r] != 0)
+			return;
+#endif
+		LUA_WRAPPER_COUNT(counters.unrefs);
+
+#ifdef LUA_WRAPPER_REF_POOL
+		if (r <= 0)
+			return;
+
+		poolPending.push_back(r);
+		liveRefs--;
+
+		if (poolPending.size() >= LUA_WRAPPER_REF_POOL_BATCH)
+			flush_refs();
+#else
+		luaL_unref(L, LUA_REGISTRYINDEX, r);
+#endif
+	}
+
+	void state::push_ref(int r)
+	{
+#ifdef LUA_WRAPPER_REF_POOL
+		lua_rawgeti(L, LUA_REGISTRYINDEX, poolRef);
+		lua_rawgeti(L, -1, r);
+		lua_remove(L, -2);
+#else
+		lua_rawgeti(L, LUA_REGISTRYINDEX, r);
+#endif
+	}
+
+#ifdef LUA_WRAPPER_REF_POOL
+	void state::init_ref_pool()
+	{
+		poolCapacity = LUA_WRAPPER_REF_POOL_SIZE;
+		poolNext = 0;
+		liveRefs = peakRefs = 0;
+		lua_createtable(L, poolCapacity, 0);
+		poolRef = luaL_ref(L, LUA_REGISTRYINDEX);
+		poolFree.reserve(poolCapacity);
+		poolPending.reserve(LUA_WRAPPER_REF_POOL_BATCH);
+	}
+
+	void state::reserve_refs(int n)
+	{
+		if (n <= poolCapacity)
+			return;
+
+		//one rehash now instead of several while the pool fills up
+		lua_createtable(L, n, 0);
+		lua_rawgeti(L, LUA_REGISTRYINDEX, poolRef);
+		for (int i = 1; i <= poolNext; i++)
+		{
+			lua_rawgeti(L, -1, i);
+			lua_rawseti(L, -3, i);
+		}
+		lua_pop(L, 1);
+		lua_rawseti(L, LUA_REGISTRYINDEX, poolRef);
+
+		poolCapacity = n;
+		poolFree.reserve(n);
+	}
+
+	void state::flush_refs()
+	{
+		if (poolPending.empty())
+			return;
+
+		lua_rawgeti(L, LUA_REGISTRYINDEX, poolRef);
+		for (int r : poolPending)
+		{
+			lua_pushnil(L);
+			lua_rawseti(L, -2, r);
+		}
+		lua_pop(L, 1);
+
+		poolFree.insert(poolFree.end(), poolPending.begin(), poolPending.end());
+		poolPending.clear();
+	}
+
+	size_t state::live_refs()
+	{
+		return liveRefs;
+	}
+
+	size_t state::peak_refs()
+	{
+		return peakRefs;
+	}
+#endif
+
+	std::string state::serialize(const local &value)
+	{
+		value.check_state_consistancy(L);
+		stack_guard guard(*this, 1);
+		value.push_value(L);
+
+		std::string out("LWv1", 4);
+		table_ids tables;
+		write_value(out, lua_gettop(L), tables, 0);
+		return out;
+	}
+
+	local state::deserialize(const std::string &data)
+	{
+		return deserialize(data.data(), data.size());
+	}
+
+	local state::deserialize(const char *data, size_t len)
+	{
+		if (len < 4 || std::memcmp(data, "LWv1", 4) != 0)
+			throw std::runtime_error("Not a serialized value");
+
+		stack_guard guard(*this, 2);
+		lua_newtable(L);
+		int tables = lua_gettop(L);
+		uint64_t count = 0;
+
+		const char *p = data + 4;
+		const char *end = data + len;
+		read_value(p, end, tables, count, 0);
+		if (p != end)
+			throw std::runtime_error("Malformed serialized value");
+
+		local lcl(*this);
+		lcl.load_value(-1);
+		return lcl;
+	}
+
+	local state::transfer(const local &value, state &to)
+	{
+		value.check_state_consistancy(L);
+		if (&to == this)
+			return value;
+
+		stack_guard guard(*this, 1);
+		stack_guard target(to, 2);
+		value.push_value(L);
+		lua_newtable(to.L);
+
+		table_ids tables;
+		copy_value_to(to, lua_gettop(L), tables, lua_gettop(to.L), 0);
+
+		local lcl(to);
+		lcl.load_value(-1);
+		return lcl;
+	}
+
+	int state::absolute(lua_State *L, int idx)
+	{
+		return idx > 0 || idx <= LUA_REGISTRYINDEX ? idx : lua_gettop(L) + idx + 1;
+	}
+
+	void state::write_value(std::string &out, int idx, table_ids &tables, int depth)
+	{
+		auto put = [&out](uint64_t v) { v = little_endian(v); out.append(reinterpret_cast<const char*>(&v), sizeof(v)); };
+
+		switch (lua_type(L, idx))
+		{
+		case LUA_TNIL:
+			out.push_back(static_cast<char>(wire::nil));
+			break;
+		case LUA_TBOOLEAN:
+			out.push_back(static_cast<char>(lua_toboolean(L, idx) ? wire::boolean_true : wire::boolean_false));
+			break;
+		case LUA_TNUMBER:
+		{
+#ifndef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+			if (lua_isinteger(L, idx))
+			{
+				out.push_back(static_cast<char>(wire::integer));
+				put(static_cast<uint64_t>(lua_tointeger(L, idx)));
+				break;
+			}
+#endif
+			double n = static_cast<double>(lua_tonumber(L, idx));
+			uint64_t bits;
+			std::memcpy(&bits, &n, sizeof(bits));
+			out.push_back(static_cast<char>(wire::number));
+			put(bits);
+			break;
+		}
+		case LUA_TSTRING:
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, idx, &len);
+			out.push_back(static_cast<char>(wire::string));
+			put(len);
+			out.append(s, len);
+			break;
+		}
+		case LUA_TTABLE:
+		{
+			const void *p = lua_topointer(L, idx);
+			auto it = tables.find(p);
+			if (it != tables.end())
+			{
+				out.push_back(static_cast<char>(wire::table_ref));
+				put(it->second);
+				break;
+			}
+
+			if (depth >= max_copy_depth)
+				throw std::runtime_error("Tables are nested too deeply to be copied");
+			if (!lua_checkstack(L, 2))
+				throw std::runtime_error("Not enough stack space to serialize a table");
+
+			//ids follow the order tables are first written in, which is the order they are read back
+			uint64_t id = tables.size();
+			tables.emplace(p, id);
+			out.push_back(static_cast<char>(wire::table));
+
+			int t = absolute(L, idx);
+			lua_pushnil(L);
+			while (lua_next(L, t))
+			{
+				write_value(out, -2, tables, depth + 1);
+				write_value(out, -1, tables, depth + 1);
+				lua_pop(L, 1);
+			}
+			out.push_back(static_cast<char>(wire::table_end));
+			break;
+		}
+		default:
+			throw std::logic_error(std::string("Cannot serialize a value of type ") + luaL_typename(L, idx));
+		}
+	}
+
+	void state::read_value(const char *&p, const char *end, int tables, uint64_t &count, int depth)
+	{
+		auto need = [&p, end](size_t n) {
+			if (static_cast<size_t>(end - p) < n)
+				throw std::runtime_error("Malformed serialized value");
+		};
+		auto get = [&p, &need]() -> uint64_t {
+			uint64_t v;
+			need(sizeof(v));
+			std::memcpy(&v, p, sizeof(v));
+			p += sizeof(v);
+			return little_endian(v);
+		};
+
+		need(1);
+		wire tag = static_cast<wire>(*p++);
+		switch (tag)
+		{
+		case wire::nil:
+			lua_pushnil(L);
+			break;
+		case wire::boolean_false:
+		case wire::boolean_true:
+			lua_pushboolean(L, tag == wire::boolean_true);
+			break;
+		case wire::number:
+		{
+			uint64_t bits = get();
+			double n;
+			std::memcpy(&n, &bits, sizeof(n));
+			lua_pushnumber(L, static_cast<lua_Number>(n));
+			break;
+		}
+		case wire::integer:
+			lua_pushinteger(L, static_cast<lua_Integer>(static_cast<int64_t>(get())));
+			break;
+		case wire::string:
+		{
+			uint64_t len = get();
+			need(static_cast<size_t>(len));
+			lua_pushlstring(L, p, static_cast<size_t>(len));
+			p += len;
+			break;
+		}
+		case wire::table:
+		{
+			if (depth >= max_copy_depth)
+				throw std::runtime_error("Tables are nested too deeply to be copied");
+			if (!lua_checkstack(L, 3))
+				throw std::runtime_error("Not enough stack space to deserialize a table");
+
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, tables, static_cast<int>(++count));
+
+			for (;;)
+			{
+				need(1);
+				if (static_cast<wire>(*p) == wire::table_end)
+					break;
+
+				read_value(p, end, tables, count, depth + 1);
+				//a nil or NaN key would raise a Lua error outside of any protected call
+				if (lua_isnil(L, -1) || (lua_type(L, -1) == LUA_TNUMBER && std::isnan(lua_tonumber(L, -1))))
+					throw std::runtime_error("Malformed serialized value");
+				read_value(p, end, tables, count, depth + 1);
+				lua_rawset(L, -3);
+			}
+			p++;
+			break;
+		}
+		case wire::table_ref:
+		{
+			uint64_t id = get();
+			if (id >= count)
+				throw std::runtime_error("Malformed serialized value");
+			lua_rawgeti(L, tables, static_cast<int>(id + 1));
+			break;
+		}
+		default:
+			throw std::runtime_error("Malformed serialized value");
+		}
+	}
+
+	void state::copy_value_to(state &to, int idx, table_ids &tables, int seen, int depth)
+	{
+		lua_State *T = to.L;
+		switch (lua_type(L, idx))
+		{
+		case LUA_TNIL:
+			lua_pushnil(T);
+			break;
+		case LUA_TBOOLEAN:
+			lua_pushboolean(T, lua_toboolean(L, idx));
+			break;
+		case LUA_TNUMBER:
+#ifndef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+			if (lua_isinteger(L, idx))
+			{
+				lua_pushinteger(T, lua_tointeger(L, idx));
+				break;
+			}
+#endif
+			lua_pushnumber(T, lua_tonumber(L, idx));
+			break;
+		case LUA_TSTRING:
+		{
+			size_t len;
+			const char *s = lua_tolstring(L, idx, &len);
+			lua_pushlstring(T, s, len);
+			break;
+		}
+		case LUA_TLIGHTUSERDATA:
+			lua_pushlightuserdata(T, lua_touserdata(L, idx));
+			break;
+		case LUA_TFUNCTION:
+		{
+			bool upvalues = lua_getupvalue(L, idx, 1) != nullptr;
+			if (upvalues)
+				lua_pop(L, 1);
+			if (!lua_iscfunction(L, idx) || upvalues)
+				throw std::logic_error("Only plain C functions can be transferred between states");
+			lua_pushcfunction(T, lua_tocfunction(L, idx));
+			break;
+		}
+		case LUA_TTABLE:
+		{
+			const void *p = lua_topointer(L, idx);
+			auto it = tables.find(p);
+			if (it != tables.end())
+			{
+				lua_rawgeti(T, seen, static_cast<int>(it->second));
+				break;
+			}
+
+			if (depth >= max_copy_depth)
+				throw std::runtime_error("Tables are nested too deeply to be copied");
+			if (!lua_checkstack(L, 2) || !lua_checkstack(T, 3))
+				throw std::runtime_error("Not enough stack space to transfer a table");
+
+			uint64_t id = tables.size() + 1;
+			tables.emplace(p, id);
+			lua_newtable(T);
+			lua_pushvalue(T, -1);
+			lua_rawseti(T, seen, static_cast<int>(id));
+
+			int t = absolute(L, idx);
+			lua_pushnil(L);
+			while (lua_next(L, t))
+			{
+				copy_value_to(to, -2, tables, seen, depth + 1);
+				copy_value_to(to, -1, tables, seen, depth + 1);
+				lua_rawset(T, -3);
+				lua_pop(L, 1);
+			}
+			break;
+		}
+		default:
+			throw std::logic_error(std::string("Cannot transfer a value of type ") + luaL_typename(L, idx));
+		}
+	}
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+	state_stats state::stats()
+	{
+		state_stats st = counters;
+		st.allocatedBytes = allocated_bytes();
+		st.peakAllocatedBytes = peak_allocated_bytes();
+		st.allocations = allocation_count();
+		return st;
+	}
+
+	void state::reset_stats()
+	{
+		state_stats st = {};
+		st.liveStrings = counters.liveStrings;
+		st.liveFunctions = counters.liveFunctions;
+		st.liveUserdata = counters.liveUserdata;
+		st.liveThreads = counters.liveThreads;
+		st.liveTables = counters.liveTables;
+		counters = st;
+
+		if (memory)
+		{
+			memory->peakBytes = memory->bytes;
+			memory->allocations = 0;
+		}
+	}
+
+	void state::start_profiling(int instructions)
+	{
+		if (instructions <= 0)
+			throw std::logic_error("The profiling interval must be at least one instruction");
+
+		register_profiler();
+		profiling = true;
+		lastSample = std::chrono::steady_clock::now();
+		lua_sethook(L, &profile_hook, LUA_MASKCOUNT, instructions);
+	}
+
+	void state::stop_profiling()
+	{
+		if (!profiling)
+			return;
+
+		lua_sethook(L, nullptr, 0, 0);
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&profile_hook));
+		lua_pushnil(L);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+		profiling = false;
+	}
+
+	std::vector<profile_entry> state::profile()
+	{
+		std::vector<profile_entry> entries;
+		entries.reserve(samples.size());
+		for (auto &e : samples)
+			entries.push_back(e.second);
+
+		std::sort(entries.begin(), entries.end(), [](const profile_entry &a, const profile_entry &b) {
+			return a.seconds > b.seconds;
+		});
+		return entries;
+	}
+
+	void state::clear_profile()
+	{
+		samples.clear();
+	}
+
+	void state::register_profiler()
+	{
+		//the hook may run on any coroutine, the registry is the one place they all share
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&profile_hook));
+		lua_pushlightuserdata(L, this);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+
+	void state::profile_hook(lua_State *L, lua_Debug *ar)
+	{
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&profile_hook));
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		state *s = static_cast<state*>(lua_touserdata(L, -1));
+		lua_pop(L, 1);
+		if (s == nullptr)
+			return;
+
+		auto now = std::chrono::steady_clock::now();
+		double elapsed = std::chrono::duration<double>(now - s->lastSample).count();
+		s->lastSample = now;
+
+		if (!lua_getinfo(L, "Snf", ar))
+			return;
+		const void *fn = lua_topointer(L, -1);
+		lua_pop(L, 1);
+
+		profile_entry &e = s->samples[fn];
+		if (e.samples == 0)
+		{
+			e.function = ar->name != nullptr ? ar->name : "?";
+			e.function += " (";
+			e.function += ar->short_src;
+			e.function += ":";
+			e.function += std::to_string(ar->linedefined);
+			e.function += ")";
+		}
+		e.samples++;
+		e.seconds += elapsed;
+	}
+#endif
+
+	/* stack_frame */
+
+	stack_frame::stack_frame(state &s) : s(&s), prev(s.frame)
+	{
+		base = top = lua_gettop(s.L);
+		s.frame = this;
+	}
+
+	stack_frame::~stack_frame()
+	{
+		assert(s->frame == this);
+		lua_settop(s->L, base);
+		s->frame = prev;
+	}
+
+	int stack_frame::size()
+	{
+		return top - base;
+	}
+
+	int stack_frame::push_slot()
+	{
+		//moves the value on top of the stack into the next free slot
+		lua_insert(s->L, ++top);
+		return top;
+	}
+
+	/* stack_guard */
+
+	stack_guard::stack_guard(state &s, int reserve) : L(s.L), frame(s.frame), top(lua_gettop(s.L)), frameTop(s.frame != nullptr ? s.frame->top : 0)
+	{
+		if (reserve > 0)
+			this->reserve(reserve);
+	}
+
+	stack_guard::~stack_guard()
+	{
+		assert(lua_gettop(L) >= mark());
+		lua_settop(L, mark());
+	}
+
+	void stack_guard::reserve(int n)
+	{
+		if (!lua_checkstack(L, n))
+			throw std::runtime_error("Not enough stack space");
+	}
+
+	int stack_guard::size() const
+	{
+		return lua_gettop(L) - mark();
+	}
+
+	int stack_guard::mark() const
+	{
+		//slots added to the enclosing frame meanwhile were inserted beneath the mark
+		return frame != nullptr ? top + frame->top - frameTop : top;
+	}
+
+	/* interned */
+
+	interned::interned() : L(nullptr), ref(LUA_NOREF)
+	{
+
+	}
+
+	interned::interned(lua_State *L, int ref) : L(L), ref(ref)
+	{
+
+	}
+
+	bool interned::is_valid() const
+	{
+		return L != nullptr;
+	}
+
+	void interned::push(lua_State *L) const
+	{
+		if (this->L == nullptr)
+			throw std::logic_error("Attempted to use an invalid interned string");
+		if (this->L != L)
+			throw std::logic_error("Inconsistant state between interned string and state");
+		lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+	}
+
+	/* table_index */
+
+	table_index::operator local()
+	{
+		return get_value();
+	}
+
+	/*
+	table_index& table_index::operator=(local &rhs)
+	{
+		check_valid();
+		rhs.check_state_consistancy(s->L);
+		lua_rawgeti(s->L, LUA_REGISTRYINDEX, tblRef);
+		lua_rawgeti(s->L, LUA_REGISTRYINDEX, idxRef);
+		rhs.push_value(s->L);
+		lua_settable(s->L, -3);
+		return *this;
+	}
+	*/
+
+	table_index& table_index::operator=(const local &rhs)
+	{
+		check_valid();
+		if (tbl == nullptr)
+			throw std::logic_error("Attempt to set the value of a table_index that is not connected to a table");
+		rhs.check_state_consistancy(s->L);
+		tbl->push_ref_value();
+		push_key();
+		rhs.push_value(s->L);
+		lua_settable(s->L, -3);
+		lua_pop(s->L, 1);
+		return *this;
+	}
+
+	table_index::table_index(state &s, local &tbl, const local &idx) : s(&s), tbl(&tbl)
+	{
+		idx.check_state_consistancy(s.L);
+
+		switch (idx.t)
+		{
+		case local::type::integer:
+			kt = key_type::integer;
+			key.integer = idx.value.integer;
+			break;
+		case local::type::number:
+			if (local::is_integral(idx.value.number, key.integer))
+				kt = key_type::integer;
+			else
+			{
+				kt = key_type::number;
+				key.number = idx.value.number;
+			}
+			break;
+		case local::type::boolean:
+			kt = key_type::boolean;
+			key.boolean = idx.value.boolean;
+			break;
+		case local::type::lightuserdata:
+			kt = key_type::lightuserdata;
+			key.lightuserdata = idx.value.lightuserdata;
+			break;
+		default:
+			//only keys that are actually reference types need to be pinned in the registry
+			kt = key_type::ref;
+			idx.push_value(s.L);
+			key.ref = s.ref();
+			break;
+		}
+	}
+
+	table_index::table_index(state &s, local &tbl, lua_Integer idx) : s(&s), tbl(&tbl), kt(key_type::integer)
+	{
+		key.integer = idx;
+	}
+
+	table_index::table_index(state &s, local &tbl, const interned &idx) : s(&s), tbl(&tbl), kt(key_type::interned)
+	{
+		if (idx.L != s.L)
+			throw std::logic_error("Inconsistant state between interned string and table");
+		//the state owns the reference, nothing to release
+		key.ref = idx.ref;
+	}
+
+	table_index::table_index() : s(nullptr), tbl(nullptr), kt(key_type::none)
+	{
+		//copied and moved along with kt even when unused
+		key.integer = 0;
+	}
+
+	table_index::table_index(const table_index &ti) : s(ti.s), tbl(ti.tbl), kt(ti.kt), key(ti.key)
+	{
+		if (kt == key_type::ref)
+			key.ref = s->share_ref(ti.key.ref);
+	}
+
+	table_index::~table_index()
+	{
+		release_key();
+	}
+
+	table_index& table_index::operator=(const table_index &rhs)
+	{
+		if (this == &rhs)
+			return *this;
+
+		release_key();
+		s = rhs.s;
+		tbl = rhs.tbl;
+		kt = rhs.kt;
+		key = rhs.key;
+		if (kt == key_type::ref)
+			key.ref = s->share_ref(rhs.key.ref);
+		return *this;
+	}
+
+	table_index& table_index::operator=(table_index &&rhs)
+	{
+		if (this == &rhs)
+			return *this;
+
+		release_key();
+		s = rhs.s;
+		tbl = rhs.tbl;
+		kt = rhs.kt;
+		key = rhs.key;
+		rhs.kt = key_type::none;
+		return *this;
+	}
+
+	void table_index::check_valid()
+	{
+		if (s == nullptr)
+			throw std::logic_error("Attempted to use an invalid table_index object");
+	}
+
+	void table_index::push_key()
+	{
+		switch (kt)
+		{
+		case key_type::none:          lua_pushnil(s->L);                               break;
+		case key_type::integer:       lua_pushinteger(s->L, key.integer);              break;
+		case key_type::number:        lua_pushnumber(s->L, key.number);                break;
+		case key_type::boolean:       lua_pushboolean(s->L, key.boolean);              break;
+		case key_type::lightuserdata: lua_pushlightuserdata(s->L, key.lightuserdata);  break;
+		case key_type::ref:           s->push_ref(key.ref);                            break;
+		case key_type::interned:      lua_rawgeti(s->L, LUA_REGISTRYINDEX, key.ref);   break;
+		}
+	}
+
+	void table_index::release_key()
+	{
+		if (kt == key_type::ref)
+			s->unref(key.ref);
+		kt = key_type::none;
+	}
+
+	local table_index::get_value()
+	{
+		check_valid();
+		if (tbl == nullptr)
+			throw std::logic_error("Attempt to get the value of a table_index that is not connected to a table");
+		tbl->push_ref_value();
+		push_key();
+		lua_gettable(s->L, -2);
+		local l(*s);
+		l.load_value();
+		lua_pop(s->L, 2);
+		return l;
+	}
+
+	/* local */
+
+	local::local() : s(nullptr), L(nullptr), t(type::nil)
+	{
+
+	}
+
+	local::local(state &s) : s(&s), L(s.L)
+	{
+
+	}
+
+	local::local(const local &lcl)
+	{
+		copy_value(lcl);
+	}
+
+	local::local(bool b) : s(nullptr), L(nullptr), t(type::boolean)
+	{
+		value.boolean = b;
+	}
+
+	local::local(lua_Number n) : s(nullptr), L(nullptr), t(type::number)
+	{
+		value.number = n;
+	}
+
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+	local::local(const char *str) : s(nullptr), L(nullptr), t(type::nil)
+	{
+		set_stateless_string(str, std::strlen(str));
+	}
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	local::local(std::string_view str) : s(nullptr), L(nullptr), t(type::nil)
+	{
+		set_stateless_string(str.data(), str.size());
+	}
+#endif
+#endif
+
+	local::local(lua_CFunction f) : s(nullptr), L(nullptr), t(type::cfunction)
+	{
+		value.cfunction = f;
+	}
+
+	local::local(void *p) : s(nullptr), L(nullptr), t(type::lightuserdata)
+	{
+		value.lightuserdata = p;
+	}
+
+	local::local(state &s, bool b) : s(&s), L(s.L), t(type::boolean)
+	{
+		value.boolean = b;
+	}
+
+	local::local(state &s, lua_Number n) : s(&s), L(s.L), t(type::number)
+	{
+		value.number = n;
+	}
+
+	local::local(state &s, const char *str) : s(&s), L(s.L), t(type::string)
+	{
+		lua_pushstring(L, str);
+		load_ref_value();
+		lua_pop(L, 1);
+	}
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	local::local(state &s, std::string_view str) : s(&s), L(s.L), t(type::string)
+	{
+		lua_pushlstring(L, str.data(), str.size());
+		load_ref_value();
+		lua_pop(L, 1);
+	}
+#endif
+
+	local::local(state &s, lua_CFunction f) : s(&s), L(s.L), t(type::cfunction)
+	{
+		value.cfunction = f;
+	}
+
+	local::local(state &s, void *p) : s(&s), L(s.L), t(type::lightuserdata)
+	{
+		value.lightuserdata = p;
+	}
+
+	local::local(local &&lcl) : s(lcl.s), L(lcl.L), t(lcl.t), stacked(lcl.stacked), value(lcl.value), cargs(0)
+	{
+		lcl.t = type::nil;
+	}
+
+	local::~local()
+	{
+		release();
+	}
+
+	local& local::operator=(const local &rhs)
+	{
+		if (this == &rhs)
+			return *this;
+
+		release();
+		copy_value(rhs);
+
+		return *this;
+	}
+
+	local& local::operator=(local &&rhs)
+	{
+		if (this == &rhs)
+			return *this;
+
+		release();
+		s = rhs.s;
+		L = rhs.L;
+		t = rhs.t;
+		stacked = rhs.stacked;
+		value = rhs.value;
+		cargs = 0;
+		rhs.t = type::nil;
+
+		return *this;
+	}
+
+	void local::copy_value(const local &lcl)
+	{
+		s = lcl.s;
+		L = lcl.L;
+		t = lcl.t;
+		value = lcl.value;
+		cargs = 0; //if lcl.cargs is not 0 then something is seriously wrong
+
+		if (is_ref_type())
+		{
+			//copies never borrow a stack slot, they must be able to outlive the frame
+			stacked = lcl.stacked;
+			duplicate_ref();
+		}
+		else
+			stacked = false;
+
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		if (t == type::stateless_string)
+			value.string = copy_string(lcl.value.string);
+#endif
+	}
+
+	bool local::is_nil()
+	{
+		return t == type::nil;
+	}
+
+	bool local::is_boolean()
+	{
+		return t == type::boolean;
+	}
+
+	bool local::is_number()
+	{
+		return t == type::number || t == type::integer;
+	}
+
+	bool local::is_integer()
+	{
+		return t == type::integer;
+	}
+
+	bool local::is_string()
+	{
+		return t == type::string;
+	}
+
+	bool local::is_function()
+	{
+		return t == type::function || t == type::cfunction;
+	}
+
+	bool local::is_cfunction()
+	{
+		return t == type::cfunction;
+	}
+
+	bool local::is_userdata()
+	{
+		return t == type::userdata || t == type::lightuserdata;
+	}
+
+	bool local::is_lightuserdata()
+	{
+		return t == type::lightuserdata;
+	}
+
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+	bool local::is_cdata()
+	{
+		return t == type::cdata;
+	}
+#endif
+
+	bool local::is_thread()
+	{
+		return t == type::thread;
+	}
+
+	bool local::is_table()
+	{
+		return t == type::table;
+	}
+
+	bool local::is_stack_local()
+	{
+		return stacked && is_ref_type();
+	}
+
+	void local::set_as_nil()
+	{
+		release();
+		t = type::nil;
+	}
+
+	void local::set_as_boolean(bool b)
+	{
+		release();
+		t = type::boolean;
+		value.boolean = b;
+	}
+
+	void local::set_as_number(lua_Number n)
+	{
+		release();
+		store_number(n);
+	}
+
+	void local::set_as_integer(lua_Integer i)
+	{
+		release();
+		t = type::integer;
+		value.integer = i;
+	}
+
+	void local::set_as_string(const char *s)
+	{
+		set_as_string(s, std::strlen(s));
+	}
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	void local::set_as_string(std::string_view s)
+	{
+		set_as_string(s.data(), s.size());
+	}
+#endif
+
+	void local::set_as_string(const char *s, size_t len)
+	{
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		if (L == nullptr)
+		{
+			release();
+			set_stateless_string(s, len);
+			return;
+		}
+#endif
+
+		check_state();
+		release();
+		t = type::string;
+		lua_pushlstring(L, s, len);
+		load_ref_value_no_type();
+		lua_pop(L, 1);
+	}
+
+	void local::set_as_cfunction(lua_CFunction f)
+	{
+		release();
+		t = type::cfunction;
+		value.cfunction = f;
+	}
+
+#ifdef LUA_WRAPPER_SMART_FUNCTIONS
+	void local::set_as_function(std::function<void()> f)
+	{
+		check_state();
+		*this = bind(*s, std::move(f));
+	}
+#endif
+
+	void local::set_as_lightuserdata(void *p)
+	{
+		release();
+		t = type::lightuserdata;
+		value.lightuserdata = p;
+	}
+
+	bool local::to_boolean()
+	{
+		if (t == type::boolean)
+			return value.boolean;
+
+		return false;
+	}
+
+	lua_Number local::to_number()
+	{
+		if (t == type::number)
+			return value.number;
+		else if (t == type::integer)
+			return static_cast<lua_Number>(value.integer);
+		else
+			return static_cast<lua_Number>(0);
+	}
+
+	lua_Integer local::to_integer()
+	{
+		if (t == type::integer)
+			return value.integer;
+		else if (t == type::number)
+			return numberToInteger(value.number);
+
+		return static_cast<lua_Integer>(0);
+	}
+
+	const char* local::to_string(size_t *len)
+	{
+		if (t == type::string)
+		{
+			push_ref_value();
+			const char *s = lua_tolstring(L, -1, len);
+			lua_pop(L, 1);
+			return s;
+		}
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		else if (t == type::stateless_string || t == type::small_string)
+		{
+			if (len != nullptr)
+				*len = stateless_length();
+			return stateless_data();
+		}
+#endif
+
+		if (len != nullptr)
+			*len = 0;
+		return nullptr;
+	}
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	std::string_view local::to_string_view()
+	{
+		size_t len;
+		const char *s = to_string(&len);
+		return s != nullptr ? std::string_view(s, len) : std::string_view();
+	}
+#endif
+
+	lua_CFunction local::to_cfunction()
+	{
+		if (t == type::cfunction)
+			return value.cfunction;
+
+		return nullptr;
+	}
+
+	void* local::to_userdata()
+	{
+		if (t == type::userdata)
+		{
+			push_ref_value();
+			void *p = lua_touserdata(L, -1);
+			lua_pop(L, 1);
+			return p;
+		}
+		else if (t == type::lightuserdata)
+			return value.lightuserdata;
+
+		return nullptr;
+	}
+
+	void local::table_set(const local &key, const local &value)
+	{
+		check_is_table();
+		key.check_state_consistancy(L);
+		value.check_state_consistancy(L);
+		push_ref_value();
+		key.push_value(L);
+		value.push_value(L);
+		lua_settable(L, -3);
+		lua_pop(L, 1);
+	}
+
+	void local::table_set(lua_Integer key, const local &value)
+	{
+		check_is_table();
+		value.check_state_consistancy(L);
+		push_ref_value();
+		lua_pushinteger(L, key);
+		value.push_value(L);
+		lua_settable(L, -3);
+		lua_pop(L, 1);
+	}
+
+	local local::table_get(const local &key)
+	{
+		check_is_table();
+		key.check_state_consistancy(L);
+		push_ref_value();
+		key.push_value(L);
+		lua_gettable(L, -2);
+		local lcl(*s);
+		lcl.load_value();
+		lua_pop(L, 2);
+		return lcl;
+	}
+
+	void local::table_set(const interned &key, const local &value)
+	{
+		check_is_table();
+		value.check_state_consistancy(L);
+		push_ref_value();
+		key.push(L);
+		value.push_value(L);
+		lua_settable(L, -3);
+		lua_pop(L, 1);
+	}
+
+	local local::table_get(const interned &key)
+	{
+		check_is_table();
+		push_ref_value();
+		key.push(L);
+		lua_gettable(L, -2);
+		local lcl(*s);
+		lcl.load_value();
+		lua_pop(L, 2);
+		return lcl;
+	}
+
+	template<typename K, typename... T>
+	void local::get_fields(std::initializer_list<K> keys, T&... out)
+	{
+		check_is_table();
+		s->check_fields(keys.size(), sizeof...(T), static_cast<int>(sizeof...(T)) + 1);
+		push_ref_value();
+		s->get_fields_at(lua_gettop(L), keys, out...);
+		lua_pop(L, 1);
+	}
+
+	template<typename K, typename... T>
+	void local::set_fields(std::initializer_list<K> keys, const T&... values)
+	{
+		check_is_table();
+		s->check_fields(keys.size(), sizeof...(T), 3);
+		push_ref_value();
+		s->set_fields_at(lua_gettop(L), keys, values...);
+		lua_pop(L, 1);
+	}
+
+	table_range<pairs_iterator> local::pairs()
+	{
+		check_is_table();
+		if (!lua_checkstack(L, 3))
+			throw std::runtime_error("Not enough stack space to iterate a table");
+		push_ref_value();
+		return table_range<pairs_iterator>(*s);
+	}
+
+	table_range<ipairs_iterator> local::ipairs()
+	{
+		check_is_table();
+		if (!lua_checkstack(L, 2))
+			throw std::runtime_error("Not enough stack space to iterate a table");
+		push_ref_value();
+		return table_range<ipairs_iterator>(*s);
+	}
+
+	local local::table_get(lua_Integer key)
+	{
+		check_is_table();
+		push_ref_value();
+		lua_pushinteger(L, key);
+		lua_gettable(L, -2);
+		local lcl(*s);
+		lcl.load_value();
+		lua_pop(L, 2);
+		return lcl;
+	}
+
+	template<typename T>
+	size_t local::table_read_into(T *out, size_t n)
+	{
+		check_is_table();
+		push_ref_value();
+
+		size_t len = raw_length(L, -1);
+		if (n > len)
+			n = len;
+
+		for (size_t i = 0; i < n; i++)
+		{
+			lua_rawgeti(L, -1, static_cast<int>(i + 1));
+			out[i] = get_traits<T>::get(L, -1);
+			lua_pop(L, 1);
+		}
+
+		lua_pop(L, 1);
+		return n;
+	}
+
+	template<typename T>
+	void local::table_append(const T *data, size_t n)
+	{
+		table_append(data, data + n);
+	}
+
+	template<typename It>
+	void local::table_append(It first, It last)
+	{
+		check_is_table();
+		push_ref_value();
+
+		int i = static_cast<int>(raw_length(L, -1));
+		for (; first != last; ++first)
+		{
+			push_traits<typename std::iterator_traits<It>::value_type>::push(L, *first);
+			lua_rawseti(L, -2, ++i);
+		}
+
+		lua_pop(L, 1);
+	}
+
+	template<typename C>
+	void local::table_append(const C &c)
+	{
+		table_append(std::begin(c), std::end(c));
+	}
+
+	size_t local::length()
+	{
+		size_t length = 0;
+
+		if (t == type::table || t == type::string)
+		{
+			push_ref_value();
+			length = raw_length(L, -1);
+			lua_pop(L, 1);
+		}
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		else if (t == type::stateless_string || t == type::small_string)
+			length = stateless_length();
+#endif
+
+		return length;
+	}
+
+#ifdef LUA_WRAPPER_INDEXABLE_LOCALS
+	/*
+	table_index& local::operator[](local key)
+	{
+		check_is_table();
+		key.check_state_consistancy(L);
+		
+		key.push_value(L);
+		int r = luaL_ref(L, LUA_REGISTRYINDEX);
+		tidx = table_index(*this, r);
+
+		return tidx;
+	}
+	*/
+
+	table_index& local::operator[](const local &key)
+	{
+		check_is_table();
+		tindex = table_index(*s, *this, key);
+		return tindex;
+	}
+
+	table_index& local::operator[](const interned &key)
+	{
+		check_is_table();
+		tindex = table_index(*s, *this, key);
+		return tindex;
+	}
+
+	table_index& local::operator[](lua_Integer key)
+	{
+		check_is_table();
+		tindex = table_index(*s, *this, key);
+		return tindex;
+	}
+
+	/*
+	table_index& local::operator[](const std::string &key)
+	{
+		check_is_table();
+		local lcl(*s, key.c_str());
+		tindex = table_index(*s, *this, lcl);
+		return tindex;
+	}
+	*/
+#endif
+
+	local& local::operator=(bool rhs)
+	{
+		set_as_boolean(rhs);
+		return *this;
+	}
+
+	local& local::operator=(lua_Number rhs)
+	{
+		set_as_number(rhs);
+		return *this;
+	}
+
+	local& local::operator=(lua_CFunction rhs)
+	{
+		set_as_cfunction(rhs);
+		return *this;
+	}
+
+	local& local::operator=(void *p)
+	{
+		set_as_lightuserdata(p);
+		return *this;
+	}
+
+	local& local::operator=(const char *s)
+	{
+		set_as_string(s);
+		return *this;
+	}
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	local& local::operator=(std::string_view s)
+	{
+		set_as_string(s);
+		return *this;
+	}
+#endif
+
+	bool local::is_ref_type() const
+	{
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		if (t == type::cdata)
+			return true;
+#endif
+		return t == type::string || t == type::function || t == type::userdata || t == type::thread || t == type::table;
+	}
+
+	int local::duplicate_ref()
+	{
+		assert(is_ref_type());
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		count_live(true);
+#endif
+		if (stacked)
+		{
+			push_ref_value();
+			stacked = false;
+			return value.ref = s->ref();
+		}
+
+		return value.ref = s->share_ref(value.ref);
+	}
+
+	void local::release()
+	{
+		if (is_table())
+			tindex = table_index();
+
+		if (L != nullptr && is_ref_type())
+		{
+			//stack slots are reclaimed by their stack_frame
+			if (!stacked)
+				s->unref(value.ref);
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+			count_live(false);
+#endif
+		}
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		else if (t == type::stateless_string)
+			release_string(value.string);
+#endif
+	}
+
+	void local::load_ref_value_no_type(int idx)
+	{
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+		count_live(true);
+#endif
+		if (s != nullptr && s->frame != nullptr)
+		{
+			if (!lua_checkstack(L, 1))
+				throw std::runtime_error("Not enough stack space for a stack local");
+			lua_pushvalue(L, idx);
+			value.ref = s->frame->push_slot();
+			stacked = true;
+			return;
+		}
+
+		lua_pushvalue(L, idx);
+		value.ref = s->ref();
+		stacked = false;
+	}
+
+#ifdef LUA_WRAPPER_INSTRUMENTATION
+	void local::count_live(bool alive)
+	{
+		size_t *n;
+		switch (t)
+		{
+		case type::string:
+			n = &s->counters.liveStrings;
+			break;
+		case type::function:
+			n = &s->counters.liveFunctions;
+			break;
+		case type::userdata:
+			n = &s->counters.liveUserdata;
+			break;
+		case type::thread:
+			n = &s->counters.liveThreads;
+			break;
+		case type::table:
+			n = &s->counters.liveTables;
+			break;
+		default:
+			return;
+		}
+
+		if (alive)
+			++*n;
+		else
+			--*n;
+	}
+#endif
+
+	void local::load_ref_value(int idx)
+	{
+		if (lua_isstring(L, idx))
+			t = type::string;
+		else if (lua_isfunction(L, idx))
+			t = type::function;
+		else if (lua_isuserdata(L, idx))
+			t = type::userdata;
+		else if (lua_isthread(L, idx))
+			t = type::thread;
+		else if (lua_istable(L, idx))
+			t = type::table;
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		else if (lua_type(L, idx) == cdata_type)
+			t = type::cdata;
+#endif
+
+		load_ref_value_no_type(idx);
+	}
+
+	void local::load_value(int idx)
+	{
+		if (lua_isnil(L, idx)) {
+			t = type::nil;
+		}
+		else if (lua_isboolean(L, idx)) {
+			t = type::boolean;
+			value.boolean = lua_toboolean(L, idx);
+		}
+#ifndef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		else if (lua_isinteger(L, idx)) {
+			t = type::integer;
+			value.integer = lua_tointeger(L, idx);
+		}
+#endif
+		//lua_isnumber would also accept numeric strings
+		else if (lua_type(L, idx) == LUA_TNUMBER) {
+			store_number(lua_tonumber(L, idx));
+		}
+		else if (lua_iscfunction(L, idx) && !has_upvalues(idx)) {
+			t = type::cfunction;
+			value.cfunction = lua_tocfunction(L, idx);
+		}
+		else if (lua_islightuserdata(L, idx)) {
+			t = type::lightuserdata;
+			value.lightuserdata = lua_touserdata(L, idx);
+		}
+		else {
+			load_ref_value(idx);
+		}
+	}
+
+	bool local::has_upvalues(int idx)
+	{
+		//C closures with upvalues can not be stored as a bare lua_CFunction
+		if (lua_getupvalue(L, idx, 1) == nullptr)
+			return false;
+		lua_pop(L, 1);
+		return true;
+	}
+
+	void local::push_ref_value() const
+	{
+		if (stacked)
+			lua_pushvalue(L, value.ref);
+		else
+			s->push_ref(value.ref);
+	}
+
+	void local::push_ref_value(lua_State *L) const
+	{
+		//stack slots and registry lookups go through the owning thread, other threads of the state get it moved over
+		push_ref_value();
+		if (L != this->L)
+			lua_xmove(this->L, L, 1);
+	}
+
+	void local::push_value(lua_State *L) const
+	{
+		if (L == nullptr)
+			L = this->L;
+
+		switch (t)
+		{
+		case type::nil:              lua_pushnil(L);                                break;
+		case type::boolean:          lua_pushboolean(L, value.boolean);             break;
+		case type::number:           lua_pushnumber(L, value.number);               break;
+		case type::integer:          lua_pushinteger(L, value.integer);             break;
+		case type::string:           push_ref_value(L);                             break;
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		case type::stateless_string: lua_pushlstring(L, value.string, get_string_header(value.string)->length); break;
+		case type::small_string:     lua_pushlstring(L, value.inlined.data, stateless_length()); break;
+#endif
+		case type::function:         push_ref_value(L);                             break;
+		case type::cfunction:        lua_pushcfunction(L, value.cfunction);         break;
+		case type::userdata:         push_ref_value(L);                             break;
+		case type::lightuserdata:    lua_pushlightuserdata(L, value.lightuserdata); break;
+		case type::thread:           push_ref_value(L);                             break;
+		case type::table:            push_ref_value(L);                             break;
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		case type::cdata:            push_ref_value(L);                             break;
+#endif
+		}
+	}
+
+	constexpr lua_Number local::integer_upper_bound()
+	{
+		//lua_Integer's maximum rounds up past itself when lua_Number has fewer digits
+		return std::numeric_limits<lua_Integer>::digits <= std::numeric_limits<lua_Number>::digits
+			? static_cast<lua_Number>((std::numeric_limits<lua_Integer>::max)())
+			: static_cast<lua_Number>((std::numeric_limits<lua_Integer>::max)()) -
+				static_cast<lua_Number>(lua_Integer(1) << (std::numeric_limits<lua_Integer>::digits - std::numeric_limits<lua_Number>::digits));
+	}
+
+	lua_Integer local::numberToInteger(lua_Number number)
+	{
+		//truncates toward zero, out of range values saturate and NaN maps to the minimum
+		const lua_Number lo = static_cast<lua_Number>((std::numeric_limits<lua_Integer>::min)());
+		return static_cast<lua_Integer>(std::fmin(std::fmax(number, lo), integer_upper_bound()));
+	}
+
+	bool local::is_integral(lua_Number number, lua_Integer &integer)
+	{
+		//the clamped conversion is always defined, out of range values and NaN fail the comparison
+		integer = numberToInteger(number);
+		return static_cast<lua_Number>(integer) == number;
+	}
+
+	void local::store_number(lua_Number n)
+	{
+#if defined(LUA_WRAPPER_IMPLEMENTATION_LUAJIT) && !defined(LUA_WRAPPER_NUMBER_STRICT)
+		lua_Integer i;
+		if (is_integral(n, i))
+		{
+			t = type::integer;
+			value.integer = i;
+			return;
+		}
+#endif
+		t = type::number;
+		value.number = n;
+	}
+
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+	void local::set_stateless_string(const char *s, size_t len)
+	{
+		if (len <= small_string_capacity)
+		{
+			t = type::small_string;
+			std::memcpy(value.inlined.data, s, len);
+			std::memset(value.inlined.data + len, 0, small_string_capacity - len);
+			value.inlined.data[small_string_capacity] = static_cast<char>(small_string_capacity - len);
+		}
+		else
+		{
+			value.string = create_string(s, len);
+			t = type::stateless_string;
+		}
+	}
+
+	const char* local::stateless_data() const
+	{
+		return t == type::small_string ? value.inlined.data : value.string;
+	}
+
+	size_t local::stateless_length() const
+	{
+		if (t == type::small_string)
+			return small_string_capacity - static_cast<unsigned char>(value.inlined.data[small_string_capacity]);
+		return get_string_header(value.string)->length;
+	}
+
+	char* local::create_string(const char *s, size_t len)
+	{
+		char *ns = reinterpret_cast<char*>(std::malloc(sizeof(string_header) + len + 1));
+		if (ns == nullptr)
+			throw std::bad_alloc();
+		string_header *h = new (ns) string_header;
+		h->refc.store(1, std::memory_order_relaxed);
+		h->length = len;
+		ns += sizeof(string_header);
+		std::memcpy(ns, s, len);
+		ns[len] = '\0';
+		return ns;
+	}
+
+	char* local::copy_string(char *s)
+	{
+		get_string_header(s)->refc.fetch_add(1, std::memory_order_relaxed);
+		return s;
+	}
+
+	void local::release_string(char *s)
+	{
+		string_header *h = get_string_header(s);
+		if (h->refc.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			h->~string_header();
+			std::free(h);
+		}
+	}
+
+	local::string_header* local::get_string_header(char *s)
+	{
+		return reinterpret_cast<string_header*>(s - sizeof(string_header));
+	}
+#endif
+
+	void local::check_state()
+	{
+		if (s == nullptr)
+			throw std::logic_error("Cannot operate on a reference-type local that is not attached to a state");
+	}
+
+	void local::check_state_consistancy(lua_State *L) const
+	{
+		//coroutines run on their own lua_State but share the registry, and so the owner, of their state
+		if (this->L != nullptr && this->L != L && state::find_owner(L) != s)
+			throw std::logic_error("Inconsistant state between locals");
+	}
+
+	void local::check_is_function()
+	{
+		if (t != type::function)
+			throw std::logic_error("Cannot call a local that is not a function");
+	}
+
+	void local::check_is_table()
+	{
+		if (t != type::table)
+			throw std::logic_error("Cannot index a local that is not a table");
+	}
+
+	template<typename T, typename... Args>
+#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
+		local local::operator()(const T &arg, const Args&... args)
+#elif defined(LUA_WRAPPER_VECTOR_RETURN)
+		std::vector<local> local::operator()(const T &arg, const Args&... args)
+#endif
+	{
+		check_is_function();
+		stack_guard guard(*s, 1 + push_count<T, Args...>::value);
+		prep_call();
+		push_call_args(arg, args...);
+		return do_call(guard);
+	}
+
+	template<typename T>
+#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
+	local local::operator()(const T &arg)
+#elif defined(LUA_WRAPPER_VECTOR_RETURN)
+	std::vector<local> local::operator()(const T &arg)
+#endif
+	{
+		check_is_function();
+		stack_guard guard(*s, 1 + push_traits<T>::count);
+		prep_call();
+		push_call_args(arg);
+		return do_call(guard);
+	}
+
+#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
+	local local::operator()()
+#elif defined(LUA_WRAPPER_VECTOR_RETURN)
+	std::vector<local> local::operator()()
+#endif
+	{
+		check_is_function();
+		stack_guard guard(*s, 1);
+		prep_call();
+		return do_call(guard);
+	}
+
+	void local::prep_call()
+	{
+		//std::cout << "Pushing function" << std::endl;
+		//std::cout << "top: " << lua_gettop(L) << std::endl;
+
+		push_ref_value();
+		cargs = 0;
+	}
+
+	void local::pcall(int nresults)
+	{
+		if (s->protected_call(static_cast<int>(cargs), nresults))
+			s->raise_error();
+	}
+
+#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
+	local local::do_call(const stack_guard &guard)
+#elif defined(LUA_WRAPPER_VECTOR_RETURN)
+	std::vector<local> local::do_call(const stack_guard &guard)
+#endif
+	{
+		//the guard was created before the function was pushed and drops the results
+		pcall(LUA_MULTRET);
+		int retc = guard.size();
+
+#if defined(LUA_WRAPPER_VECTOR_RETURN)
+		std::vector<local> returnValues(retc);
+		for (int i = 0; i < retc; i++)
+		{
+			local lcl(*s);
+			lcl.load_value(i - retc);
+			returnValues[i] = std::move(lcl);
+		}
+		return returnValues;
+#else
+		if (retc == 0)
+			return local(*s);
+		else if (retc == 1)
+		{
+			local lcl(*s);
+			lcl.load_value(-1);
+			return lcl;
+		}
+#if defined(LUA_WRAPPER_SINGLE_RETURN)
+		else
+		{
+			throw std::runtime_error("A function may not return more than 1 value");
+		}
+#elif defined(LUA_WRAPPER_TABLE_RETURN)
+		else
+		{
+			local tbl = s->create_table(retc, 0);
+			for (int i = 0; i < retc; i++)
+			{
+				local retv(*s);
+				retv.load_value(i - retc);
+				tbl.table_set(i + 1, retv);
+			}
+			return tbl;
+		}
+#endif
+#endif
+	}
+
+	template<typename T, typename... Args>
+	void local::push_call_args(const T &arg, const Args&... args)
+	{
+		push_call_args(arg);
+		push_call_args(args...);
+	}
+
+	template<typename T>
+	void local::push_call_args(const T &arg)
+	{
+		push_traits<T>::push(L, arg);
+		cargs += push_traits<T>::count;
+	}
+
+	void local::push_call_args()
+	{
+
+	}
+
+	template<typename... R, typename... Args>
+	std::tuple<R...> local::call(const Args&... args)
+	{
+		const int nresults = static_cast<int>(sizeof...(R));
+		check_is_function();
+		stack_guard guard(*s, (std::max)(1 + push_count<Args...>::value, nresults));
+		prep_call();
+		push_call_args(args...);
+		pcall(nresults);
+
+		return get_results<R...>(std::index_sequence_for<R...>());
+	}
+
+	template<typename... R, typename... Args>
+	result<std::tuple<R...>> local::try_call(const Args&... args)
+	{
+		const int nresults = static_cast<int>(sizeof...(R));
+		check_is_function();
+		stack_guard guard(*s, (std::max)(1 + push_count<Args...>::value, nresults));
+		prep_call();
+		push_call_args(args...);
+
+		//the traceback is only wanted by lua::error, so failures here do not build one
+		int status = s->protected_call(static_cast<int>(cargs), nresults, false);
+		cargs = 0;
+		if (status != 0)
+			return result<std::tuple<R...>>(s->pop_error());
+
+		return result<std::tuple<R...>>(get_results<R...>(std::index_sequence_for<R...>()));
+	}
+
+	template<typename... R, typename... Args>
+	std::tuple<R...> local::resume(const Args&... args)
+	{
+		lua_State *co = to_thread();
+		if (!is_resumable())
+			throw std::logic_error("Attempted to resume a coroutine that is dead or running");
+
+		//arguments go through this state first so locals are checked against it
+		cargs = 0;
+		push_call_args(args...);
+		lua_xmove(L, co, static_cast<int>(cargs));
+
+		int status = resume_thread(co, L, static_cast<int>(cargs));
+		cargs = 0;
+		if (status != 0 && status != LUA_YIELD)
+		{
+			lua_xmove(co, L, 1);
+			lua_settop(co, 0);
+			throw error(s->pop_error(), local());
+		}
+
+		const int nresults = static_cast<int>(sizeof...(R));
+		if (!lua_checkstack(L, nresults))
+			throw std::runtime_error("Not enough stack space for coroutine results");
+		lua_settop(co, nresults);
+		lua_xmove(co, L, nresults);
+
+		std::tuple<R...> results = get_results<R...>(std::index_sequence_for<R...>());
+		lua_pop(L, nresults);
+		return results;
+	}
+
+	bool local::is_resumable()
+	{
+		if (t != type::thread)
+			return false;
+
+		lua_State *co = to_thread();
+		if (co == L)
+			return false;
+
+		switch (lua_status(co))
+		{
+		case LUA_YIELD:
+			return true;
+		case 0:
+		{
+			//a coroutine that has not started yet only has its function on the stack
+			lua_Debug ar;
+			return lua_getstack(co, 0, &ar) == 0 && lua_gettop(co) > 0;
+		}
+		default:
+			return false;
+		}
+	}
+
+	lua_State* local::to_thread()
+	{
+		if (t != type::thread)
+			throw std::logic_error("Attempted to resume a non-thread local");
+
+		push_ref_value();
+		lua_State *co = lua_tothread(L, -1);
+		lua_pop(L, 1);
+		return co;
+	}
+
+	int local::resume_thread(lua_State *co, lua_State *from, int nargs)
+	{
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		(void)from;
+		return lua_resume(co, nargs);
+#else
+		return lua_resume(co, from, nargs);
+#endif
+	}
+
+	template<typename... R, size_t... I>
+	std::tuple<R...> local::get_results(std::index_sequence<I...>)
+	{
+		static_assert(!borrows_stack<R...>::value, "Results are popped before they are returned, read strings as std::string or lua::local");
+
+		//negative indices stay valid if a stack_frame inserts slots beneath the results
+		const int n = static_cast<int>(sizeof...(R));
+		return std::tuple<R...>(get_result<R>(static_cast<int>(I) - n)...);
+	}
+
+	template<typename T>
+	T local::get_result(int idx)
+	{
+		return s->get_value<T>(idx);
+	}
+
+	void push_traits<local>::push(lua_State *L, const local &v)
+	{
+		v.check_state_consistancy(L);
+		v.push_value(L);
+	}
+
+	/* error */
+
+	error::error(const local &value, const local &traceback) : std::runtime_error("Lua error"), val(value), tb(traceback), messageBuilt(false), tbBuilt(false)
+	{
+
+	}
+
+	const char* error::what() const noexcept
+	{
+		if (!messageBuilt)
+		{
+			try
+			{
+				message = describe(val);
+			}
+			catch (...)
+			{
+				return std::runtime_error::what();
+			}
+			messageBuilt = true;
+		}
+		return message.c_str();
+	}
+
+	const local& error::value() const
+	{
+		return val;
+	}
+
+	bool error::has_traceback() const
+	{
+		return tb.t != local::type::nil;
+	}
+
+	const std::string& error::traceback() const
+	{
+		if (!tbBuilt)
+		{
+			size_t len;
+			const char *s = const_cast<local&>(tb).to_string(&len);
+			if (s != nullptr)
+				tbString.assign(s, len);
+			tbBuilt = true;
+		}
+		return tbString;
+	}
+
+	std::string error::describe(const local &value)
+	{
+		local &v = const_cast<local&>(value);
+		size_t len;
+		const char *s = v.to_string(&len);
+		if (s != nullptr)
+			return std::string(s, len);
+		if (v.is_integer())
+			return std::to_string(v.to_integer());
+		if (v.is_number())
+			return std::to_string(v.to_number());
+		if (v.is_nil() || v.L == nullptr)
+			return "Unknown error";
+
+		v.push_value();
+		std::string msg = std::string("Error object is a ") + luaL_typename(v.L, -1) + " value";
+		lua_pop(v.L, 1);
+		return msg;
+	}
+
+	/* result */
+
+	template<typename T>
+	result<T>::result(T &&v) : success(true), val(std::move(v))
+	{
+
+	}
+
+	template<typename T>
+	result<T>::result(const local &err) : success(false), val(), err(err)
+	{
+
+	}
+
+	template<typename T>
+	bool result<T>::ok() const
+	{
+		return success;
+	}
+
+	template<typename T>
+	result<T>::operator bool() const
+	{
+		return success;
+	}
+
+	template<typename T>
+	T& result<T>::value()
+	{
+		if (!success)
+			throw lua::error(err, local());
+		return val;
+	}
+
+	template<typename T>
+	const local& result<T>::error() const
+	{
+		return err;
+	}
+
+	template<typename T>
+	std::string result<T>::message() const
+	{
+		return success ? std::string() : lua::error::describe(err);
+	}
+
+	/* table iteration */
+
+	value_view::value_view(state &s, int idx, bool key) : s(&s), idx(idx), key(key)
+	{
+
+	}
+
+	int value_view::type() const
+	{
+		return lua_type(s->L, idx);
+	}
+
+	bool value_view::is_nil() const
+	{
+		return lua_isnil(s->L, idx);
+	}
+
+	template<typename T>
+	bool value_view::is() const
+	{
+		return get_traits<T>::is(s->L, idx);
+	}
+
+	template<typename T>
+	T value_view::as() const
+	{
+		if (!key || lua_type(s->L, idx) != LUA_TNUMBER)
+			return s->get_value<T>(idx);
+
+		//read a copy, a converted number key must be taken as std::string to outlive this call
+		lua_pushvalue(s->L, idx);
+		T v = s->get_value<T>(-1);
+		lua_pop(s->L, 1);
+		return v;
+	}
+
+	local value_view::get() const
+	{
+		return s->get_value<local>(idx);
+	}
+
+	pairs_iterator::pairs_iterator() : s(nullptr), active(false)
+	{
+
+	}
+
+	pairs_iterator::pairs_iterator(state &s) : s(&s), active(true)
+	{
+		lua_pushnil(s.L);
+		next();
+	}
+
+	pairs_iterator::pairs_iterator(pairs_iterator &&it) : s(it.s), active(it.active)
+	{
+		it.active = false;
+	}
+
+	pairs_iterator::~pairs_iterator()
+	{
+		//left early, the key and value are still above the table
+		if (active)
+			lua_pop(s->L, 2);
+	}
+
+	pairs_iterator& pairs_iterator::operator++()
+	{
+		lua_pop(s->L, 1);
+		next();
 		return *this;
 	}
 
-	void local::copy_value(const local &lcl)
+	table_entry pairs_iterator::operator*() const
 	{
-		s = lcl.s;
-		L = lcl.L;
-		t = lcl.t;
-		value = lcl.value;
-		cargs = 0; //if lcl.cargs is not 0 then something is seriously wrong
+		return table_entry{ value_view(*s, -2, true), value_view(*s, -1) };
+	}
+
+	bool pairs_iterator::operator==(const pairs_iterator &rhs) const
+	{
+		return active == rhs.active;
+	}
+
+	bool pairs_iterator::operator!=(const pairs_iterator &rhs) const
+	{
+		return active != rhs.active;
+	}
+
+	void pairs_iterator::next()
+	{
+		//pops the key, pushes the next key and value or nothing at the end
+		active = lua_next(s->L, -2) != 0;
+	}
+
+	ipairs_iterator::ipairs_iterator() : s(nullptr), i(0), active(false)
+	{
+
+	}
+
+	ipairs_iterator::ipairs_iterator(state &s) : s(&s), i(0), active(true)
+	{
+		next();
+	}
+
+	ipairs_iterator::ipairs_iterator(ipairs_iterator &&it) : s(it.s), i(it.i), active(it.active)
+	{
+		it.active = false;
+	}
+
+	ipairs_iterator::~ipairs_iterator()
+	{
+		if (active)
+			lua_pop(s->L, 1);
+	}
+
+	ipairs_iterator& ipairs_iterator::operator++()
+	{
+		lua_pop(s->L, 1);
+		next();
+		return *this;
+	}
+
+	array_entry ipairs_iterator::operator*() const
+	{
+		return array_entry{ i, value_view(*s, -1) };
+	}
+
+	bool ipairs_iterator::operator==(const ipairs_iterator &rhs) const
+	{
+		return active == rhs.active;
+	}
+
+	bool ipairs_iterator::operator!=(const ipairs_iterator &rhs) const
+	{
+		return active != rhs.active;
+	}
+
+	void ipairs_iterator::next()
+	{
+		lua_rawgeti(s->L, -1, static_cast<int>(++i));
+		if (lua_isnil(s->L, -1))
+		{
+			lua_pop(s->L, 1);
+			active = false;
+		}
+	}
+
+	template<typename It>
+	table_range<It>::table_range(state &s) : s(&s), owns(true), begun(false)
+	{
+
+	}
+
+	template<typename It>
+	table_range<It>::table_range(table_range &&r) : s(r.s), owns(r.owns), begun(r.begun)
+	{
+		r.owns = false;
+	}
+
+	template<typename It>
+	table_range<It>::~table_range()
+	{
+		if (owns)
+			lua_pop(s->L, 1);
+	}
+
+	template<typename It>
+	It table_range<It>::begin()
+	{
+		if (begun)
+			throw std::logic_error("A table range can only be iterated once");
+		begun = true;
+		return It(*s);
+	}
+
+	template<typename It>
+	It table_range<It>::end()
+	{
+		return It();
+	}
+
+	/* function binding */
+
+	template<typename F>
+	local function_binder<F>::bind(state &s, F f)
+	{
+		return bind(s, f, std::integral_constant<bool, stateless>());
+	}
+
+	template<typename F>
+	local function_binder<F>::bind(state &s, F &f, std::true_type)
+	{
+		//every instance of an empty callable behaves the same, so one shared copy is enough
+		new (&stateless_instance()) F(f);
+		return local(s, &call_stateless);
+	}
+
+	template<typename F>
+	local function_binder<F>::bind(state &s, F &f, std::false_type)
+	{
+		void *ud = lua_newuserdata(s.L, sizeof(F));
+		new (ud) F(std::move(f));
+
+		if (!std::is_trivially_destructible<F>::value)
+		{
+			//one metatable per callable type, keyed by the address of gc
+			lua_pushlightuserdata(s.L, reinterpret_cast<void*>(&gc));
+			lua_rawget(s.L, LUA_REGISTRYINDEX);
+			if (lua_isnil(s.L, -1))
+			{
+				lua_pop(s.L, 1);
+				lua_createtable(s.L, 0, 1);
+				lua_pushcfunction(s.L, &gc);
+				lua_setfield(s.L, -2, "__gc");
+				lua_pushlightuserdata(s.L, reinterpret_cast<void*>(&gc));
+				lua_pushvalue(s.L, -2);
+				lua_rawset(s.L, LUA_REGISTRYINDEX);
+			}
+			lua_setmetatable(s.L, -2);
+		}
+
+		lua_pushcclosure(s.L, &call_upvalue, 1);
+
+		local lcl(s);
+		s.push_function_local(lcl);
+		return lcl;
+	}
+
+	template<typename F>
+	F& function_binder<F>::stateless_instance()
+	{
+		static typename std::aligned_storage<sizeof(F), alignof(F)>::type storage;
+		return *reinterpret_cast<F*>(&storage);
+	}
+
+	template<typename F>
+	int function_binder<F>::call_stateless(lua_State *L)
+	{
+		return dispatch(L, stateless_instance());
+	}
+
+	template<typename F>
+	int function_binder<F>::call_upvalue(lua_State *L)
+	{
+		return dispatch(L, *static_cast<F*>(lua_touserdata(L, lua_upvalueindex(1))));
+	}
+
+	template<typename F>
+	int function_binder<F>::gc(lua_State *L)
+	{
+		static_cast<F*>(lua_touserdata(L, 1))->~F();
+		return 0;
+	}
+
+	template<typename F>
+	int function_binder<F>::dispatch(lua_State *L, F &f)
+	{
+		//arguments are checked before any C++ object is alive, luaL_argerror does not return
+		int bad = argument_checker<arguments>::check(L);
+		if (bad != 0)
+			return luaL_argerror(L, bad, lua_pushfstring(L, "unexpected %s", luaL_typename(L, bad)));
+		if (!check_object(L, std::integral_constant<bool, traits::is_method>()))
+			return luaL_argerror(L, 1, object_error(L, std::integral_constant<bool, traits::is_method>()));
+
+		int n;
+		{
+			//suspended for the call only, lua_error and lua_yield below skip destructors
+			state::frame_suspension suspended(state::find_owner(L));
+			try
+			{
+				n = call(L, f, std::is_void<typename traits::result_type>(), sequence());
+			}
+			catch (const std::exception &e)
+			{
+				lua_pushstring(L, e.what());
+				n = -1;
+			}
+			catch (...)
+			{
+				lua_pushstring(L, "Unknown C++ exception");
+				n = -1;
+			}
+		}
+
+		//yielding must happen outside the try block, it may unwind the C stack
+		if (n == scheduler::yielded)
+			return lua_yield(L, 0);
+		if (n < 0)
+			return lua_error(L);
+
+		return n;
+	}
+
+	template<typename F>
+	bool function_binder<F>::check_object(lua_State *L, std::true_type)
+	{
+		return class_<typename traits::object_type>::check(L, 1) != nullptr;
+	}
+
+	template<typename F>
+	bool function_binder<F>::check_object(lua_State *, std::false_type)
+	{
+		return true;
+	}
+
+	template<typename F>
+	const char* function_binder<F>::object_error(lua_State *L, std::true_type)
+	{
+		return class_<typename traits::object_type>::registered(L) ? "object expected" : "object of a class that is not registered";
+	}
+
+	template<typename F>
+	const char* function_binder<F>::object_error(lua_State *, std::false_type)
+	{
+		return "object expected";
+	}
+
+	template<typename F>
+	template<size_t... I>
+	int function_binder<F>::call(lua_State *L, F &f, std::true_type, std::index_sequence<I...>)
+	{
+		(void)L;
+		invoke(f, get_traits<typename std::tuple_element<I, arguments>::type>::get(L, static_cast<int>(I) + 1)...);
+		return 0;
+	}
+
+	template<typename F>
+	template<size_t... I>
+	int function_binder<F>::call(lua_State *L, F &f, std::false_type, std::index_sequence<I...>)
+	{
+		return push_result(L, invoke(f, get_traits<typename std::tuple_element<I, arguments>::type>::get(L, static_cast<int>(I) + 1)...));
+	}
+
+	template<typename F>
+	template<typename R>
+	int function_binder<F>::push_result(lua_State *L, R &&r)
+	{
+		using T = typename std::decay<R>::type;
+		push_traits<T>::push(L, r);
+		return push_traits<T>::count;
+	}
+
+	template<typename F>
+	template<typename T>
+	int function_binder<F>::push_result(lua_State *L, std::future<T> &&f)
+	{
+		return scheduler::suspend(L, std::move(f));
+	}
+
+	template<typename F>
+	template<typename G, typename... P>
+	auto function_binder<F>::invoke(G &g, P&&... p) -> decltype(g(std::forward<P>(p)...))
+	{
+		return g(std::forward<P>(p)...);
+	}
+
+	template<typename F>
+	template<typename M, typename C, typename O, typename... P>
+	auto function_binder<F>::invoke(M C::*m, O *obj, P&&... p) -> decltype((obj->*m)(std::forward<P>(p)...))
+	{
+		return (obj->*m)(std::forward<P>(p)...);
+	}
+
+	template<typename F>
+	local bind(state &s, F &&f)
+	{
+		return function_binder<typename std::decay<F>::type>::bind(s, std::forward<F>(f));
+	}
+
+#ifdef LUA_WRAPPER_HAS_CPP17
+	template<auto F>
+	local bind(state &s)
+	{
+		struct trampoline
+		{
+			static int call(lua_State *L)
+			{
+				auto f = F;
+				return function_binder<decltype(F)>::dispatch(L, f);
+			}
+		};
+
+		return local(s, &trampoline::call);
+	}
+#endif
+
+	/* class_ */
+
+	template<typename T>
+	char class_<T>::key;
+
+	template<typename T>
+	class_<T>::class_(state &s, const char *name) : s(&s), name(name)
+	{
+		lua_State *L = s.L;
+
+		if (!push_metatable(L))
+		{
+			lua_pop(L, 1);
+			lua_createtable(L, 0, 6);
+
+			lua_pushstring(L, name);
+			lua_setfield(L, -2, "__name");
+
+			//getmetatable would hand scripts the method and accessor tables
+			lua_pushboolean(L, 0);
+			lua_setfield(L, -2, "__metatable");
+
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setfield(L, -3, "__index");
+			lua_setfield(L, -2, "__methods");
+
+			if (!std::is_trivially_destructible<T>::value)
+			{
+				lua_pushcfunction(L, &gc);
+				lua_setfield(L, -2, "__gc");
+			}
+
+			lua_pushlightuserdata(L, &key);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, LUA_REGISTRYINDEX);
+		}
+
+		lua_pop(L, 1);
+	}
+
+	template<typename T>
+	template<typename... A>
+	class_<T>& class_<T>::constructor()
+	{
+		lua_State *L = s->L;
+
+		lua_getglobal(L, name);
+		if (!lua_istable(L, -1))
+		{
+			lua_pop(L, 1);
+			lua_newtable(L);
+			lua_pushvalue(L, -1);
+			lua_setglobal(L, name);
+		}
+
+		lua_pushcfunction(L, &construct<A...>);
+		lua_setfield(L, -2, "new");
+		lua_pop(L, 1);
+
+		return *this;
+	}
+
+	template<typename T>
+	template<typename F>
+	class_<T>& class_<T>::method(const char *name, F f)
+	{
+		local fn = bind(*s, std::move(f));
+
+		push_metatable(s->L);
+		lua_getfield(s->L, -1, "__methods");
+		fn.push_value(s->L);
+		lua_setfield(s->L, -2, name);
+		lua_pop(s->L, 2);
+
+		return *this;
+	}
+
+	template<typename T>
+	template<typename V>
+	class_<T>& class_<T>::property(const char *name, V T::*member, bool writable)
+	{
+		lua_State *L = s->L;
+		ensure_properties();
+
+		//the accessors are closures over the member pointer and check self like methods do
+		push_metatable(L);
+		lua_getfield(L, -1, "__getters");
+		new (lua_newuserdata(L, sizeof(member))) (V T::*)(member);
+		lua_pushcclosure(L, &get_property<V>, 1);
+		lua_setfield(L, -2, name);
+		lua_pop(L, 1);
+
+		if (writable)
+		{
+			lua_getfield(L, -1, "__setters");
+			new (lua_newuserdata(L, sizeof(member))) (V T::*)(member);
+			lua_pushcclosure(L, &set_property<V>, 1);
+			lua_setfield(L, -2, name);
+			lua_pop(L, 1);
+		}
+
+		lua_pop(L, 1);
+
+		return *this;
+	}
+
+	template<typename T>
+	class_<T>& class_<T>::allow_light_userdata(bool allow)
+	{
+		push_metatable(s->L);
+		lua_pushboolean(s->L, allow);
+		lua_setfield(s->L, -2, "__lightuserdata");
+		lua_pop(s->L, 1);
+
+		return *this;
+	}
+
+	template<typename T>
+	template<typename... A>
+	local class_<T>::create(state &s, A&&... args)
+	{
+		void *ud = lua_newuserdata(s.L, sizeof(T));
+		try
+		{
+			new (ud) T(std::forward<A>(args)...);
+		}
+		catch (...)
+		{
+			lua_pop(s.L, 1);
+			throw;
+		}
+
+		if (!push_metatable(s.L))
+		{
+			//without a metatable there is no __gc to destroy the object later
+			static_cast<T*>(ud)->~T();
+			lua_pop(s.L, 2);
+			throw std::logic_error("Cannot create an object of a class that has not been registered");
+		}
+		lua_setmetatable(s.L, -2);
+
+		local lcl(s);
+		lcl.load_value();
+		lua_pop(s.L, 1);
+		return lcl;
+	}
+
+	template<typename T>
+	bool class_<T>::registered(lua_State *L)
+	{
+		bool r = push_metatable(L);
+		lua_pop(L, 1);
+		return r;
+	}
+
+	template<typename T>
+	bool class_<T>::is(lua_State *L, int idx)
+	{
+		if (!lua_isuserdata(L, idx))
+			return false;
+
+		//without T's metatable there is no telling what a userdata holds
+		if (!push_metatable(L))
+		{
+			lua_pop(L, 1);
+			return false;
+		}
 
-		if (is_ref_type())
+		if (lua_islightuserdata(L, idx))
+		{
+			lua_getfield(L, -1, "__lightuserdata");
+			bool allowed = lua_toboolean(L, -1) != 0;
+			lua_pop(L, 2);
+			return allowed;
+		}
+
+		if (!lua_getmetatable(L, idx))
 		{
-			push_ref_value();
-			load_ref_value_no_type();
 			lua_pop(L, 1);
+			return false;
 		}
 
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-		if (t == type::stateless_string)
-			value.string = copy_string(lcl.value.string);
-#endif
+		bool same = lua_rawequal(L, -1, -2) != 0;
+		lua_pop(L, 2);
+		return same;
 	}
 
-	bool local::is_nil()
+	template<typename T>
+	T* class_<T>::check(lua_State *L, int idx)
 	{
-		return t == type::nil;
+		if (!is(L, idx))
+			return nullptr;
+		return static_cast<T*>(lua_touserdata(L, idx));
 	}
 
-	bool local::is_boolean()
+	template<typename T>
+	bool class_<T>::push_metatable(lua_State *L)
 	{
-		return t == type::boolean;
+		lua_pushlightuserdata(L, &key);
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		return !lua_isnil(L, -1);
 	}
 
-	bool local::is_number()
+	template<typename T>
+	void class_<T>::ensure_properties()
 	{
-		return t == type::number || t == type::integer;
-	}
+		lua_State *L = s->L;
 
-	bool local::is_integer()
-	{
-		return t == type::integer;
-	}
+		push_metatable(L);
+		lua_getfield(L, -1, "__getters");
+		bool present = !lua_isnil(L, -1);
+		lua_pop(L, 1);
 
-	bool local::is_string()
-	{
-		return t == type::string;
-	}
+		if (!present)
+		{
+			lua_newtable(L);
+			lua_setfield(L, -2, "__getters");
+			lua_newtable(L);
+			lua_setfield(L, -2, "__setters");
+
+			lua_getfield(L, -1, "__methods");
+			lua_getfield(L, -2, "__getters");
+			lua_pushcclosure(L, &index, 2);
+			lua_setfield(L, -2, "__index");
+
+			lua_getfield(L, -1, "__setters");
+			lua_pushcclosure(L, &newindex, 1);
+			lua_setfield(L, -2, "__newindex");
+		}
 
-	bool local::is_function()
-	{
-		return t == type::function || t == type::cfunction;
+		lua_pop(L, 1);
 	}
 
-	bool local::is_cfunction()
+	template<typename T>
+	int class_<T>::gc(lua_State *L)
 	{
-		return t == type::cfunction;
+		static_cast<T*>(lua_touserdata(L, 1))->~T();
+		return 0;
 	}
 
-	bool local::is_userdata()
+	template<typename T>
+	int class_<T>::index(lua_State *L)
 	{
-		return t == type::userdata || t == type::lightuserdata;
-	}
+		//upvalue 1 holds the methods, upvalue 2 the property getters
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		if (!lua_isnil(L, -1))
+			return 1;
+		lua_pop(L, 1);
 
-	bool local::is_lightuserdata()
-	{
-		return t == type::lightuserdata;
-	}
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(2));
+		if (lua_isnil(L, -1))
+			return 1;
 
-	bool local::is_thread()
-	{
-		return t == type::thread;
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 1);
+		return 1;
 	}
 
-	bool local::is_table()
+	template<typename T>
+	int class_<T>::newindex(lua_State *L)
 	{
-		return t == type::table;
+		//upvalue 1 holds the property setters
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		if (lua_isnil(L, -1))
+			return luaL_error(L, "cannot set field '%s'", lua_isstring(L, 2) ? lua_tostring(L, 2) : luaL_typename(L, 2));
+
+		lua_pushvalue(L, 1);
+		lua_pushvalue(L, 3);
+		lua_call(L, 2, 0);
+		return 0;
 	}
 
-	void local::set_as_nil()
+	template<typename T>
+	template<typename V>
+	int class_<T>::get_property(lua_State *L)
 	{
-		release();
-		t = type::nil;
-	}
+		T *self = check(L, 1);
+		if (self == nullptr)
+			return luaL_argerror(L, 1, "object expected");
 
-	void local::set_as_boolean(bool b)
-	{
-		release();
-		t = type::boolean;
-		value.boolean = b;
+		V T::*member = *static_cast<V T::**>(lua_touserdata(L, lua_upvalueindex(1)));
+		push_traits<typename std::decay<V>::type>::push(L, self->*member);
+		return push_traits<typename std::decay<V>::type>::count;
 	}
 
-	void local::set_as_number(lua_Number n)
+	template<typename T>
+	template<typename V>
+	int class_<T>::set_property(lua_State *L)
 	{
-		release();
-		t = type::number;
-		value.number = n;
-		integerize();
+		T *self = check(L, 1);
+		if (self == nullptr)
+			return luaL_argerror(L, 1, "object expected");
+		if (!get_traits<V>::is(L, 2))
+			return luaL_argerror(L, 2, lua_pushfstring(L, "unexpected %s", luaL_typename(L, 2)));
+
+		V T::*member = *static_cast<V T::**>(lua_touserdata(L, lua_upvalueindex(1)));
+		self->*member = get_traits<V>::get(L, 2);
+		return 0;
 	}
 
-	void local::set_as_integer(lua_Integer i)
+	template<typename T>
+	template<typename... A>
+	int class_<T>::construct(lua_State *L)
 	{
-		release();
-		t = type::integer;
-		value.integer = i;
-	}
+		int bad = argument_checker<std::tuple<typename std::decay<A>::type...>>::check(L);
+		if (bad != 0)
+			return luaL_argerror(L, bad, lua_pushfstring(L, "unexpected %s", luaL_typename(L, bad)));
 
-	void local::set_as_string(const char *s)
-	{
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-		if (L == nullptr)
+		void *ud = lua_newuserdata(L, sizeof(T));
+
+		bool constructed = false;
+		try
 		{
-			release();
-			t = type::stateless_string;
-			size_t slen = std::strlen(s);
-			value.string = reinterpret_cast<char*>(std::malloc(slen + 1));
-			std::memcpy(value.string, s, slen + 1);
-			return;
+			construct_at<A...>(L, ud, std::index_sequence_for<A...>());
+			constructed = true;
+		}
+		catch (const std::exception &e)
+		{
+			lua_pushstring(L, e.what());
+		}
+		catch (...)
+		{
+			lua_pushstring(L, "Unknown C++ exception");
 		}
-#endif
 
-		check_state();
-		release();
-		t = type::string;
-		lua_pushstring(L, s);
-		load_ref_value_no_type();
-		lua_pop(L, 1);
+		if (!constructed)
+			return lua_error(L);
+
+		push_metatable(L);
+		lua_setmetatable(L, -2);
+		return 1;
 	}
 
-	void local::set_as_cfunction(lua_CFunction f)
+	template<typename T>
+	template<typename... A, size_t... I>
+	void class_<T>::construct_at(lua_State *L, void *ud, std::index_sequence<I...>)
 	{
-		release();
-		t = type::cfunction;
-		value.cfunction = f;
+		new (ud) T(get_traits<typename std::decay<A>::type>::get(L, static_cast<int>(I) + 1)...);
 	}
 
-	void local::set_as_function(std::function<void()> f)
+	/* sandbox */
+
+	sandbox::sandbox(state &s) : s(&s), base(LUA_NOREF), env(LUA_NOREF)
 	{
-		release();
-		t = type::function;
-		
+		lua_State *L = s.L;
+		stack_guard guard(s, 5);
+
+		//shallow, the tables it holds are only copied into the environments that read them
+		s.push_globals();
+		int g = lua_gettop(L);
+		lua_newtable(L);
+		lua_pushnil(L);
+		while (lua_next(L, g))
+		{
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, g + 1);
+		}
+		base = s.ref();
+
+		reset();
 	}
 
-	void local::set_as_lightuserdata(void *p)
+	sandbox::~sandbox()
 	{
-		release();
-		t = type::lightuserdata;
-		value.lightuserdata = p;
+		s->unref(env);
+		s->unref(base);
 	}
 
-	bool local::to_boolean()
+	local sandbox::load_string(const char *str, const char *name)
 	{
-		if (t == type::boolean)
-			return value.boolean;
-
-		return false;
+		load(str, std::strlen(str), name != nullptr ? name : str);
+		local lcl(*s);
+		s->push_function_local(lcl);
+		return lcl;
 	}
 
-	lua_Number local::to_number()
+	void sandbox::do_string(const char *str)
 	{
-		if (t == type::number)
-			return value.number;
-		else if (t == type::integer)
-			return static_cast<lua_Number>(value.integer);
-		else
-			return static_cast<lua_Number>(0);
+		load(str, std::strlen(str), str);
+		if (s->protected_call(0, 0))
+			s->raise_error();
 	}
 
-	lua_Integer local::to_integer()
+	local sandbox::globals()
 	{
-		if (t == type::integer)
-			return value.integer;
-		else if (t == type::number)
-			return numberToInteger(value.number);
-
-		return static_cast<lua_Integer>(0);
+		s->push_ref(env);
+		local lcl = s->get_value<local>(-1);
+		lua_pop(s->L, 1);
+		return lcl;
 	}
 
-	const char* local::to_string()
+	void sandbox::reset()
 	{
-		if (t == type::string)
+		lua_State *L = s->L;
+		stack_guard guard(*s, 8);
+
+		lua_newtable(L);
+		int e = lua_gettop(L);
+
+		//original table -> its copy in this environment, the globals map to the environment itself
+		lua_newtable(L);
+		int memo = e + 1;
+		s->push_globals();
+		lua_pushvalue(L, e);
+		lua_rawset(L, memo);
+		s->push_ref(base);
+		lua_pushvalue(L, e);
+		lua_rawset(L, memo);
+
+		lua_createtable(L, 0, 2);
+		s->push_ref(base);
+		lua_pushvalue(L, memo);
+		lua_pushcclosure(L, &index, 2);
+		lua_setfield(L, -2, "__index");
+		lua_pushboolean(L, 0);
+		lua_setfield(L, -2, "__metatable");
+		lua_setmetatable(L, e);
+
+		//the state's require reads the real package.loaded
+		s->push_ref(base);
+		lua_getfield(L, -1, "require");
+		if (lua_isfunction(L, -1))
 		{
-			push_ref_value();
-			const char *s = lua_tostring(L, -1);
-			lua_pop(L, 1);
-			return s;
+			lua_pushvalue(L, e);
+			lua_pushvalue(L, memo);
+			lua_pushcclosure(L, &require, 3);
+			lua_setfield(L, e, "require");
 		}
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-		else if (t == type::stateless_string)
-			return value.string;
-#endif
+		lua_settop(L, e);
 
-		return nullptr;
+		int r = s->ref();
+		s->unref(env);
+		env = r;
 	}
 
-	lua_CFunction local::to_cfunction()
+	void sandbox::load(const char *str, size_t len, const char *name)
 	{
-		if (t == type::cfunction)
-			return value.cfunction;
+		lua_State *L = s->L;
+		LUA_WRAPPER_COUNT(s->counters.compiles);
+		if (luaL_loadbuffer(L, str, len, name))
+			s->raise_error();
 
-		return nullptr;
+		s->push_ref(env);
+#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		lua_setfenv(L, -2);
+#else
+		//the first upvalue of a main chunk is always _ENV
+		if (lua_setupvalue(L, -2, 1) == nullptr)
+			lua_pop(L, 1);
+#endif
 	}
 
-	void* local::to_userdata()
+	bool sandbox::copy_table(lua_State *L, int memo, int depth)
 	{
-		if (t == type::userdata)
+		lua_pushvalue(L, -1);
+		lua_rawget(L, memo);
+		if (!lua_isnil(L, -1))
 		{
-			push_ref_value();
-			void *p = lua_touserdata(L, -1);
-			lua_pop(L, 1);
-			return p;
+			lua_remove(L, -2);
+			return true;
 		}
-		else if (t == type::lightuserdata)
-			return value.lightuserdata;
+		lua_pop(L, 1);
 
-		return nullptr;
+		//lua_CFunctions call this too, so failures are reported instead of thrown
+		if (depth >= state::max_copy_depth || !lua_checkstack(L, 6))
+			return false;
+
+		int src = lua_gettop(L);
+		lua_newtable(L);
+		int dst = src + 1;
+		lua_pushvalue(L, src);
+		lua_pushvalue(L, dst);
+		lua_rawset(L, memo);
+		if (lua_getmetatable(L, src))
+			lua_setmetatable(L, dst);
+
+		lua_pushnil(L);
+		while (lua_next(L, src))
+		{
+			if (lua_istable(L, -1) && !copy_table(L, memo, depth + 1))
+				return false;
+			lua_pushvalue(L, -2);
+			lua_insert(L, -2);
+			lua_rawset(L, dst);
+		}
+
+		lua_remove(L, src);
+		return true;
 	}
 
-	void local::local::table_set(local key, local value)
+	int sandbox::index(lua_State *L)
 	{
-		check_is_table();
-		key.check_state_consistancy(L);
-		value.check_state_consistancy(L);
-		push_ref_value();
-		key.push_value(L);
-		value.push_value(L);
-		lua_settable(L, -3);
-		lua_pop(L, 1);
+		//upvalues: the snapshot and the copy memo, the copy is stored so the next read is a plain one
+		lua_settop(L, 2);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, lua_upvalueindex(1));
+		if (!lua_istable(L, -1))
+			return 1;
+
+		if (!copy_table(L, lua_upvalueindex(2), 0))
+			return luaL_error(L, "a global is nested too deeply to copy into the sandbox");
+		lua_pushvalue(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 1);
+		return 1;
 	}
 
-	void local::table_set(lua_Integer key, local value)
+	int sandbox::require(lua_State *L)
 	{
-		check_is_table();
-		value.check_state_consistancy(L);
-		push_ref_value();
-		lua_pushinteger(L, key);
-		value.push_value(L);
-		lua_settable(L, -3);
+		//upvalues: the state's require, the environment and the copy memo
+		const char *name = luaL_checkstring(L, 1);
+		lua_settop(L, 1);
+		lua_getfield(L, lua_upvalueindex(2), LUA_LOADLIBNAME);
+		if (!lua_istable(L, -1))
+			return luaL_error(L, "package is not a table in the sandbox");
+		lua_getfield(L, -1, "loaded");
+		if (!lua_istable(L, -1))
+			return luaL_error(L, "package.loaded is not a table in the sandbox");
+		int loaded = lua_gettop(L);
+
+		lua_getfield(L, loaded, name);
+		if (!lua_isnil(L, -1))
+			return 1;
 		lua_pop(L, 1);
+
+		lua_pushvalue(L, lua_upvalueindex(1));
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 1);
+		if (lua_istable(L, -1) && !copy_table(L, lua_upvalueindex(3), 0))
+			return luaL_error(L, "module '%s' is nested too deeply to copy into the sandbox", name);
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, loaded, name);
+		return 1;
 	}
 
-	local local::table_get(local key)
+	/* memoized_function */
+
+	memoized_function local::memoized(size_t capacity)
 	{
-		check_is_table();
-		key.check_state_consistancy(L);
-		push_ref_value();
-		key.push_value(L);
-		lua_gettable(L, -2);
-		local lcl(*s);
-		lcl.load_value();
-		lua_pop(L, 1);
-		return lcl;
+		check_is_function();
+		return memoized_function(*this, capacity);
 	}
 
-	local local::table_get(lua_Integer key)
+	memoized_function::memoized_function(const local &fn, size_t capacity) : fn(fn), limit(capacity)
 	{
-		check_is_table();
-		push_ref_value();
-		lua_pushinteger(L, key);
-		lua_gettable(L, -2);
-		local lcl(*s);
-		lcl.load_value();
-		lua_pop(L, 1);
-		return lcl;
+		if (capacity == 0)
+			throw std::logic_error("A memoized function needs room for at least one result");
 	}
 
-	size_t local::length()
+#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
+	template<typename... Args>
+	local memoized_function::operator()(const Args&... args)
 	{
-		size_t length = 0;
+		key.clear();
+		append_keys(args...);
 
-		if (t == type::table || t == type::string)
+		auto it = index.find(key);
+		if (it != index.end())
 		{
-			push_ref_value();
-			length = lua_objlen(L, -1);
-			lua_pop(L, 1);
+			entries.splice(entries.begin(), entries, it->second);
+			LUA_WRAPPER_COUNT(fn.s->counters.memoHits);
+			return it->second->result;
 		}
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-		else if (t == type::stateless_string)
-			length = std::strlen(value.string);
+
+		LUA_WRAPPER_COUNT(fn.s->counters.memoMisses);
+		local result = fn(args...);
+
+		entries.push_front(entry{ key, result });
+		index.emplace(entries.front().key, entries.begin());
+		if (entries.size() > limit)
+		{
+			index.erase(entries.back().key);
+			entries.pop_back();
+		}
+
+		return result;
+	}
 #endif
 
-		return length;
+	size_t memoized_function::size() const
+	{
+		return entries.size();
 	}
 
-#ifdef LUA_WRAPPER_INDEXABLE_LOCALS
-	/*
-	table_index& local::operator[](local key)
+	size_t memoized_function::capacity() const
 	{
-		check_is_table();
-		key.check_state_consistancy(L);
-		
-		key.push_value(L);
-		int r = luaL_ref(L, LUA_REGISTRYINDEX);
-		tidx = table_index(*this, r);
+		return limit;
+	}
 
-		return tidx;
+	void memoized_function::clear()
+	{
+		index.clear();
+		entries.clear();
 	}
-	*/
 
-	table_index& local::operator[](local key)
+	void memoized_function::append_keys()
 	{
-		check_is_table();
-		tindex = table_index(*s, value.ref, key);
-		return tindex;
+
 	}
 
-	table_index& local::operator[](lua_Integer key)
+	template<typename T, typename... Args>
+	void memoized_function::append_keys(const T &arg, const Args&... args)
 	{
-		check_is_table();
-		local lcl((lua_Number)key);
-		tindex = table_index(*s, value.ref, lcl);
-		return tindex;
+		append_key(arg);
+		append_keys(args...);
 	}
 
-	/*
-	table_index& local::operator[](const std::string &key)
+	void memoized_function::append_key(bool v)
 	{
-		check_is_table();
-		local lcl(*s, key.c_str());
-		tindex = table_index(*s, value.ref, lcl);
-		return tindex;
+		key.push_back('b');
+		key.push_back(v ? 1 : 0);
 	}
-	*/
-#endif
 
-	local& local::operator=(bool rhs)
+	template<typename T>
+	typename std::enable_if<std::is_arithmetic<T>::value>::type memoized_function::append_key(T v)
 	{
-		set_as_boolean(rhs);
-		return *this;
+#ifndef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
+		//integers and floats are told apart like math.type does
+		if (std::is_integral<T>::value)
+		{
+			int64_t i = static_cast<int64_t>(v);
+			key.push_back('i');
+			append_bytes(&i, sizeof(i));
+			return;
+		}
+#endif
+		double n = static_cast<double>(v);
+		key.push_back('n');
+		append_bytes(&n, sizeof(n));
 	}
 
-	local& local::operator=(lua_Number rhs)
+	void memoized_function::append_key(const char *v)
 	{
-		set_as_number(rhs);
-		return *this;
+		size_t len = std::strlen(v);
+		key.push_back('s');
+		append_bytes(&len, sizeof(len));
+		key.append(v, len);
 	}
 
-	local& local::operator=(lua_CFunction rhs)
+	void memoized_function::append_key(const std::string &v)
 	{
-		set_as_cfunction(rhs);
-		return *this;
+		size_t len = v.size();
+		key.push_back('s');
+		append_bytes(&len, sizeof(len));
+		key.append(v);
 	}
 
-	local& local::operator=(void *p)
+#ifdef LUA_WRAPPER_HAS_CPP17
+	void memoized_function::append_key(std::string_view v)
 	{
-		set_as_lightuserdata(p);
-		return *this;
+		size_t len = v.size();
+		key.push_back('s');
+		append_bytes(&len, sizeof(len));
+		key.append(v.data(), len);
 	}
+#endif
 
-	local& local::operator=(const char *s)
+	void memoized_function::append_key(const interned &v)
 	{
-		set_as_string(s);
-		return *this;
+		//equal strings intern to the same reference, so the reference is the key
+		if (v.L != fn.L)
+			throw std::logic_error("Inconsistant state between interned string and memoized function");
+		key.push_back('r');
+		append_bytes(&v.ref, sizeof(v.ref));
 	}
 
-	bool local::is_ref_type()
+	template<typename T>
+	typename std::enable_if<!std::is_arithmetic<T>::value>::type memoized_function::append_key(const T &)
 	{
-		return t == type::string || t == type::function || t == type::userdata || t == type::thread || t == type::table;
+		static_assert(sizeof(T) == 0, "Memoized functions only take numbers, booleans and strings");
 	}
 
-	int local::duplicate_ref()
+	void memoized_function::append_bytes(const void *p, size_t n)
 	{
-		assert(is_ref_type());
-		lua_rawgeti(L, LUA_REGISTRYINDEX, value.ref);
-		return value.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		key.append(static_cast<const char*>(p), n);
 	}
 
-	void local::release()
+	/* scheduler */
+
+	scheduler::scheduler(state &s) : s(&s), current(nullptr), suspended(false), idleBudget(0), idleStep(0)
 	{
-		if (is_table())
-			tindex = table_index();
+		if (from(s.L) != nullptr)
+			throw std::logic_error("A scheduler is already attached to this state");
 
-		if (L != nullptr && is_ref_type())
-			luaL_unref(L, LUA_REGISTRYINDEX, value.ref);
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-		else if (t == type::stateless_string)
-			release_string(value.string);
-#endif
+		lua_pushlightuserdata(s.L, reinterpret_cast<void*>(&from));
+		lua_pushlightuserdata(s.L, this);
+		lua_rawset(s.L, LUA_REGISTRYINDEX);
 	}
 
-	void local::load_ref_value_no_type(int idx)
+	scheduler::~scheduler()
 	{
-		lua_pushvalue(L, idx);
-		value.ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		lua_pushlightuserdata(s->L, reinterpret_cast<void*>(&from));
+		lua_pushnil(s->L);
+		lua_rawset(s->L, LUA_REGISTRYINDEX);
 	}
 
-	void local::load_ref_value(int idx)
+	template<typename... Args>
+	void scheduler::spawn(const local &fn, const Args&... args)
 	{
-		if (lua_isstring(L, idx))
-			t = type::string;
-		else if (lua_isfunction(L, idx))
-			t = type::function;
-		else if (lua_isuserdata(L, idx))
-			t = type::userdata;
-		else if (lua_isthread(L, idx))
-			t = type::thread;
-		else if (lua_istable(L, idx))
-			t = type::table;
-
-		load_ref_value_no_type(idx);
+		start(fn, nullptr, args...);
 	}
 
-	void local::load_value(int idx)
+	size_t scheduler::poll()
 	{
-		if (lua_isnil(L, idx)) {
-			t = type::nil;
-		}
-		else if (lua_isboolean(L, idx)) {
-			t = type::boolean;
-			value.boolean = lua_toboolean(L, idx);
+		//resuming may suspend coroutines again, so take the ready ones out first
+		std::vector<task> ready;
+		for (size_t i = 0; i < waiting.size();)
+		{
+			if (waiting[i].on.ready())
+			{
+				ready.push_back(std::move(waiting[i]));
+				waiting.erase(waiting.begin() + i);
+			}
+			else
+				i++;
 		}
-#ifdef LUA_WRAPPER_IMPLEMENTATION_LUAJIT
-		else if (lua_isnumber(L, idx)) {
-			if ((lua_Number)lua_tointeger(L, idx) == lua_tonumber(L, idx)) {
-				t = type::integer;
-				value.integer = lua_tointeger(L, idx);
+
+		std::exception_ptr error;
+		for (task &t : ready)
+		{
+			try
+			{
+				int n = t.on.push ? t.on.push(t.co) : 0;
+				resume(t, n);
 			}
-			else {
-				t = type::number;
-				value.number = lua_tonumber(L, idx);
+			catch (...)
+			{
+				if (!error)
+					error = std::current_exception();
 			}
 		}
-#else
-		else if (lua_isinteger(L, idx)) {
-			t = type::integer;
-			value.integer = lua_tointeger(L, idx);
-		}
-		else if (lua_isnumber(L, idx)) {
-			t = type::number;
-			value.number = lua_tonumber(L, idx);
-		}
-#endif
-		else if (lua_iscfunction(L, idx)) {
-			t = type::cfunction;
-			value.cfunction = lua_tocfunction(L, idx);
-		}
-		else if (lua_islightuserdata(L, idx)) {
-			t = type::lightuserdata;
-			value.lightuserdata = lua_touserdata(L, idx);
-		}
-		else {
-			load_ref_value(idx);
+
+		if (error)
+			std::rethrow_exception(error);
+
+		return ready.size();
+	}
+
+	void scheduler::run()
+	{
+		//coroutines that yielded without a future are always ready, so wait is set whenever poll found nothing
+		bool collected = false;
+		while (!waiting.empty())
+		{
+			if (poll() != 0)
+			{
+				collected = false;
+				continue;
+			}
+
+			//once a cycle is finished there is nothing left to collect until scripts run again
+			if (idleBudget.count() > 0 && !collected)
+			{
+				collected = s->gc_idle(idleBudget, idleStep);
+				if (waiting.front().on.ready())
+					continue;
+			}
+
+			waiting.front().on.wait();
 		}
 	}
 
-	void local::push_ref_value()
+	void scheduler::set_idle_gc(std::chrono::steady_clock::duration budget, int kilobytes)
 	{
-		lua_rawgeti(L, LUA_REGISTRYINDEX, value.ref);
+		idleBudget = budget;
+		idleStep = kilobytes;
 	}
 
-	void local::push_value(lua_State *L)
+	size_t scheduler::pending() const
 	{
-		if (L == nullptr)
-			L = this->L;
+		return waiting.size();
+	}
 
-		switch (t)
-		{
-		case type::nil:              lua_pushnil(L);                                break;
-		case type::boolean:          lua_pushboolean(L, value.boolean);             break;
-		case type::number:           lua_pushnumber(L, value.number);               break;
-		case type::integer:          lua_pushinteger(L, value.integer);             break;
-		case type::string:           push_ref_value();                              break;
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-		case type::stateless_string: lua_pushstring(L, value.string);               break;
+#ifdef LUA_WRAPPER_HAS_COROUTINES
+	template<typename... Args>
+	scheduler::awaitable scheduler::async(const local &fn, const Args&... args)
+	{
+		std::shared_ptr<completion> c = std::make_shared<completion>();
+		start(fn, c, args...);
+		return awaitable(c);
+	}
 #endif
-		case type::function:         push_ref_value();                              break;
-		case type::cfunction:        lua_pushcfunction(L, value.cfunction);         break;
-		case type::userdata:         push_ref_value();                              break;
-		case type::lightuserdata:    lua_pushlightuserdata(L, value.lightuserdata); break;
-		case type::thread:           push_ref_value();                              break;
-		case type::table:            push_ref_value();                              break;
-		}
+
+	template<typename... Args>
+	void scheduler::start(const local &fn, std::shared_ptr<completion> done, const Args&... args)
+	{
+		task t;
+		//a copy never borrows a stack slot, the coroutine may outlive the caller's stack_frame
+		local th = s->create_thread(fn);
+		t.thread = th;
+		t.co = t.thread.to_thread();
+		t.done = std::move(done);
+
+		int n = 0;
+		int expand[] = { 0, (push_traits<Args>::push(s->L, args), n += push_traits<Args>::count)... };
+		(void)expand;
+		lua_xmove(s->L, t.co, n);
+
+		resume(t, n);
 	}
 
-	lua_Integer local::numberToInteger(lua_Number number)
+	void scheduler::resume(task &t, int nargs)
 	{
-		static_assert(std::is_same<lua_Number, double>::value, "lua_Number MUST be double");
+		current = t.co;
+		suspended = false;
+		int status = local::resume_thread(t.co, s->L, nargs);
+		current = nullptr;
 
-		union
+		if (status != LUA_YIELD)
 		{
-			double d;
-			int i[2];
-		} u;
+			finish(t, status);
+			return;
+		}
 
-		u.d = number + 6755399441055744.0;
-		return u.i[Platform::checkEndianness() == Platform::Endianness::Big ? 1 : 0];
+		lua_settop(t.co, 0);
+		if (suspended)
+		{
+			t.on = std::move(next);
+			next = wake();
+			suspended = false;
+		}
+		else
+		{
+			//a plain coroutine.yield, continue on the next poll
+			t.on.ready = [] { return true; };
+			t.on.wait = nullptr;
+			t.on.push = nullptr;
+		}
+		waiting.push_back(std::move(t));
 	}
 
-	void local::integerize()
+	void scheduler::finish(task &t, int status)
 	{
-		assert(t == type::number || t == type::integer);
+		std::string error;
+		if (status != 0)
+			error = lua_isstring(t.co, -1) ? lua_tostring(t.co, -1) : "Unknown error in coroutine";
 
-		if (t == type::integer)
+		if (!t.done)
+		{
+			lua_settop(t.co, 0);
+			if (status != 0)
+				throw std::runtime_error(error);
 			return;
+		}
 
-		value.integer = numberToInteger(value.number);
-		t = type::integer;
+		if (status == 0 && lua_gettop(t.co) > 0)
+		{
+			lua_pushvalue(t.co, 1);
+			lua_xmove(t.co, s->L, 1);
+			local r(*s);
+			r.load_value();
+			lua_pop(s->L, 1);
+			t.done->result = r;
+		}
+		lua_settop(t.co, 0);
+
+		t.done->failed = status != 0;
+		t.done->error = std::move(error);
+		t.done->finished = true;
+
+#ifdef LUA_WRAPPER_HAS_COROUTINES
+		std::coroutine_handle<> h = t.done->handle;
+		if (h)
+			h.resume();
+#endif
 	}
 
-#ifdef LUA_WRAPPER_STATELESS_STRINGS
-	char* local::create_string(const char *s)
+	scheduler* scheduler::from(lua_State *L)
 	{
-		size_t slen = std::strlen(s);
-		char *ns = reinterpret_cast<char*>(std::malloc(sizeof(uint32_t) + slen + 1));
-		(*reinterpret_cast<uint32_t*>(ns)) = 1;
-		ns += sizeof(uint32_t);
-		std::memcpy(ns, s, slen + 1);
-		return ns;
+		lua_pushlightuserdata(L, reinterpret_cast<void*>(&from));
+		lua_rawget(L, LUA_REGISTRYINDEX);
+		scheduler *sc = static_cast<scheduler*>(lua_touserdata(L, -1));
+		lua_pop(L, 1);
+		return sc;
 	}
 
-	char* local::copy_string(char *s)
+	template<typename T>
+	int scheduler::suspend(lua_State *L, std::future<T> &&f)
 	{
-		uint32_t *refc = get_string_refc(s);
-		(*refc)++;
-		return s;
+		scheduler *sc = from(L);
+		if (sc == nullptr)
+			throw std::logic_error("A future was returned to Lua without a scheduler attached to the state");
+		if (sc->current != L)
+			throw std::logic_error("A future can only be waited on from a coroutine started by the scheduler");
+		if (!f.valid())
+			throw std::logic_error("An invalid future was returned to Lua");
+
+		//std::function must be copyable, std::future is not
+		auto fut = std::make_shared<std::future<T>>(std::move(f));
+		sc->next.ready = [fut] { return fut->wait_for(std::chrono::seconds(0)) == std::future_status::ready; };
+		sc->next.wait = [fut] { fut->wait(); };
+		sc->next.push = [fut](lua_State *co) { return push_future(co, *fut); };
+		sc->suspended = true;
+		return yielded;
 	}
 
-	void local::release_string(char *s)
+	template<typename T>
+	int scheduler::push_future(lua_State *L, std::future<T> &f)
+	{
+		//a failed future resumes the coroutine with nil and the message, like io functions do
+		try
+		{
+			T v = f.get();
+			push_traits<T>::push(L, v);
+			return push_traits<T>::count;
+		}
+		catch (const std::exception &e)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, e.what());
+		}
+		catch (...)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, "Unknown C++ exception");
+		}
+		return 2;
+	}
+
+	int scheduler::push_future(lua_State *L, std::future<void> &f)
 	{
-		uint32_t *refc = get_string_refc(s);
-		if (--(*refc) == 0)
-			std::free(refc);
+		try
+		{
+			f.get();
+			return 0;
+		}
+		catch (const std::exception &e)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, e.what());
+		}
+		catch (...)
+		{
+			lua_pushnil(L);
+			lua_pushstring(L, "Unknown C++ exception");
+		}
+		return 2;
 	}
 
-	uint32_t* local::get_string_refc(char *s)
+#ifdef LUA_WRAPPER_HAS_COROUTINES
+	scheduler::awaitable::awaitable(std::shared_ptr<completion> c) : c(std::move(c))
 	{
-		return reinterpret_cast<uint32_t*>(s - sizeof(uint32_t));
+
 	}
-#endif
 
-	void local::check_state()
+	bool scheduler::awaitable::await_ready() const
 	{
-		if (s == nullptr)
-			throw std::logic_error("Cannot operate on a reference-type local that is not attached to a state");
+		return c->finished;
 	}
 
-	void local::check_state_consistancy(lua_State *L)
+	bool scheduler::awaitable::await_suspend(std::coroutine_handle<> h)
 	{
-		if (this->L != nullptr && this->L != L)
-			throw std::logic_error("Inconsistant state between locals");
+		//the Lua coroutine may already have run to completion inside async
+		if (c->finished)
+			return false;
+		c->handle = h;
+		return true;
 	}
 
-	void local::check_is_function()
+	local scheduler::awaitable::await_resume()
 	{
-		if (t != type::function)
-			throw std::logic_error("Cannot call a local that is not a function");
+		if (c->failed)
+			throw std::runtime_error(c->error);
+		return c->result;
 	}
+#endif
 
-	void local::check_is_table()
+#ifdef LUA_WRAPPER_STATE_POOL
+	/* state_pool */
+
+	state_pool::state_pool(size_t n, const char *bootstrap) : queued(0), running(0), submitted(0), finished(0), next(0), stopping(false)
 	{
-		if (t != type::table)
-			throw std::logic_error("Cannot index a local that is not a table");
+		if (n == 0)
+			n = std::thread::hardware_concurrency();
+		if (n == 0)
+			n = 1;
+
+		//every state is ready before any thread starts so a failing bootstrap throws here
+		for (size_t i = 0; i < n; i++)
+		{
+			std::unique_ptr<worker> w(new worker);
+			w->s.reset(new state());
+			w->s->open_libs();
+			if (bootstrap != nullptr)
+				w->s->do_string(bootstrap);
+			workers.push_back(std::move(w));
+		}
+
+		for (size_t i = 0; i < n; i++)
+			workers[i]->t = std::thread(&state_pool::run, this, i);
 	}
 
-	template<typename T, typename... Args>
-#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
-		local local::operator()(T arg, Args... args)
-#elif define(LUA_WRAPPER_VECTOR_RETURN)
-		std::vector<local> local::operator()(T arg, Args... args)
-#endif
+	state_pool::~state_pool()
 	{
-		check_is_function();
-		prep_call();
-		push_call_args(arg, std::forward<Args>(args)...);
-		return do_call();
+		{
+			std::lock_guard<std::mutex> lock(m);
+			stopping = true;
+		}
+		work.notify_all();
+
+		for (auto &w : workers)
+			w->t.join();
 	}
 
-	template<typename T>
-#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
-	local local::operator()(T arg)
-#elif define(LUA_WRAPPER_VECTOR_RETURN)
-	std::vector<local> local::operator()(T arg)
-#endif
+	template<typename F>
+	auto state_pool::submit(F &&f) -> std::future<decltype(f(std::declval<state&>()))>
 	{
-		check_is_function();
-		prep_call();
-		push_call_args(arg);
-		return do_call();
+		typedef decltype(f(std::declval<state&>())) R;
+
+		//std::function must be copyable, packaged_task is not
+		auto task = std::make_shared<std::packaged_task<R(state&)>>(std::forward<F>(f));
+		std::future<R> result = task->get_future();
+		push([task](state &s) { (*task)(s); });
+		return result;
 	}
 
-#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
-	local local::operator()()
-#elif define(LUA_WRAPPER_VECTOR_RETURN)
-	std::vector<local> local::operator()()
-#endif
-	
+	std::future<local> state_pool::submit(const char *chunk)
 	{
-		prep_call();
-		return do_call();
+		std::string source(chunk);
+		return submit([source](state &s)
+		{
+			local fn = s.load_string(source.c_str());
+			return detach(std::get<0>(fn.call<local>()));
+		});
 	}
 
-	void local::prep_call()
+	void state_pool::wait_idle()
 	{
-		//std::cout << "Pushing function" << std::endl;
-		//std::cout << "top: " << lua_gettop(L) << std::endl;
+		//the calling job counts as running, it would wait for itself
+		if (this_worker().pool == this)
+			throw std::logic_error("wait_idle can not be called from a state_pool job");
 
-		push_ref_value();
-		cargs = 0;
+		std::unique_lock<std::mutex> lock(m);
+		idle.wait(lock, [this] { return queued == 0 && running == 0; });
 	}
 
-#if defined(LUA_WRAPPER_SINGLE_RETURN) || defined(LUA_WRAPPER_TABLE_RETURN)
-	local local::do_call()
-#elif define(LUA_WRAPPER_VECTOR_RETURN)
-	std::vector<local> local::do_call()
-#endif
+	template<typename T>
+	T state_pool::wait(std::future<T> &f)
 	{
-		int prevTop = lua_gettop(L);
-
-		if (lua_pcall(L, cargs, LUA_MULTRET, 0))
+		worker_id &id = this_worker();
+		if (id.pool == this)
 		{
-			const char *err = lua_tostring(L, -1);
-			lua_pop(L, 1);
-			throw std::runtime_error(err);
+			//nested jobs run on this worker's state, where the waiting job may have a stack_frame open
+			state::frame_suspension suspended(workers[id.index]->s.get());
+			std::function<void(state&)> job;
+			for (;;)
+			{
+				//taken before looking at f, so a job finishing in between is not missed
+				size_t seen;
+				{
+					std::lock_guard<std::mutex> lock(m);
+					seen = submitted + finished;
+				}
+
+				if (f.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+					break;
+				if (take(id.index, job))
+				{
+					execute(id.index, job);
+					continue;
+				}
+
+				//futures fulfilled outside the pool signal nothing, they are checked every millisecond
+				std::unique_lock<std::mutex> lock(m);
+				progress.wait_for(lock, std::chrono::milliseconds(1), [&] { return submitted + finished != seen; });
+			}
 		}
 
-		int currTop = lua_gettop(L);
+		return f.get();
+	}
+
+	size_t state_pool::size() const
+	{
+		return workers.size();
+	}
 
-		int retc = -prevTop + currTop + cargs + 1;
+	state* state_pool::this_state()
+	{
+		worker_id &id = this_worker();
+		return id.pool == this ? workers[id.index]->s.get() : nullptr;
+	}
 
-		if (retc == 0)
-			return local(*s);
-		else if (retc == 1)
+	local state_pool::detach(const local &lcl)
+	{
+		switch (lcl.t)
 		{
-			local lcl(*s);
-			lcl.load_value(-1);
-			return lcl;
+		case local::type::nil:
+		case local::type::boolean:
+		case local::type::number:
+		case local::type::integer:
+		case local::type::lightuserdata:
+		case local::type::cfunction: //closures with upvalues are loaded as type::function
+		{
+			local r(lcl);
+			r.s = nullptr;
+			r.L = nullptr;
+			return r;
 		}
-#if defined(LUA_WRAPPER_SINGLE_RETURN)
-		else
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		case local::type::stateless_string:
+		case local::type::small_string:
+			return lcl;
+		case local::type::string:
 		{
-			throw std::runtime_error("A function may not return more than 1 value");
+			size_t len;
+			const char *p = const_cast<local&>(lcl).to_string(&len);
+			local r;
+			r.set_as_string(p, len);
+			return r;
 		}
-#elif defined(LUA_WRAPPER_TABLE_RETURN)
-		else
+#endif
+		default:
+			break;
+		}
+
+		throw std::logic_error("Only value type locals can be detached from their state");
+	}
+
+	void state_pool::push(std::function<void(state&)> job)
+	{
+		worker_id &id = this_worker();
+
 		{
-			local tbl = s->create_table(retc, 0);
-			for (int i = 0; i < retc; i++)
+			std::lock_guard<std::mutex> lock(m);
+			if (stopping)
+				throw std::logic_error("Cannot submit jobs to a state_pool that is shutting down");
+
+			size_t i = id.pool == this ? id.index : next++ % workers.size();
 			{
-				local retv(*s);
-				retv.load_value(-i - 1);
-				tbl.table_set(i, retv);
+				std::lock_guard<std::mutex> wlock(workers[i]->m);
+				workers[i]->jobs.push_back(std::move(job));
 			}
-			lua_pop(L, retc);
-			return tbl;
+			queued++;
+			submitted++;
 		}
-#elif define(LUA_WRAPPER_VECTOR_RETURN)
-		else
+		work.notify_one();
+		progress.notify_all();
+	}
+
+	bool state_pool::take(size_t i, std::function<void(state&)> &job)
+	{
+		size_t n = workers.size();
+
+		for (size_t k = 0; k < n; k++)
 		{
-			std::vector<local> returnValues(retc);
-			for (int i = 0; i < retc; i++)
+			worker &w = *workers[(i + k) % n];
+			std::lock_guard<std::mutex> lock(w.m);
+			if (w.jobs.empty())
+				continue;
+
+			//own jobs are taken LIFO while they are still hot, stolen ones FIFO
+			if (k == 0)
+			{
+				job = std::move(w.jobs.back());
+				w.jobs.pop_back();
+			}
+			else
 			{
-				local lcl(*s);
-				lcl.load_value(-i - 1);
-				returnValues[i] = lcl;
+				job = std::move(w.jobs.front());
+				w.jobs.pop_front();
 			}
-			lua_pop(L, retc);
-			return returnValues;
+			return true;
 		}
-#endif
+
+		return false;
 	}
 
-	template<typename T, typename... Args>
-	void local::push_call_args(T arg, Args... args)
+	void state_pool::run(size_t i)
 	{
-		push_call_args(arg);
-		push_call_args(std::forward<Args>(args)...);
+		this_worker() = worker_id{ this, i };
+
+		for (;;)
+		{
+			size_t seen;
+			{
+				std::lock_guard<std::mutex> lock(m);
+				seen = submitted;
+			}
+
+			std::function<void(state&)> job;
+			if (!take(i, job))
+			{
+				//queued still counts jobs other workers took but have not started, only a new one is worth another look
+				std::unique_lock<std::mutex> lock(m);
+				work.wait(lock, [&] { return stopping || submitted != seen; });
+				if (stopping && submitted == seen)
+					return;
+				continue;
+			}
+
+			execute(i, job);
+		}
 	}
 
-	template<typename T>
-	void local::push_call_args(T arg) = delete;
+	void state_pool::execute(size_t i, std::function<void(state&)> &job)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m);
+			queued--;
+			running++;
+		}
 
-	template<>
-	void local::push_call_args<local>(local arg)
+		//packaged_task stores exceptions in the future, nothing escapes here
+		job(*workers[i]->s);
+		job = nullptr;
+
+		bool done;
+		{
+			std::lock_guard<std::mutex> lock(m);
+			running--;
+			finished++;
+			done = queued == 0 && running == 0;
+		}
+		progress.notify_all();
+		if (done)
+			idle.notify_all();
+	}
+
+	state_pool::worker_id& state_pool::this_worker()
 	{
-		arg.check_state_consistancy(L);
-		arg.push_value(L);
-		cargs++;
+		static thread_local worker_id id = { nullptr, 0 };
+		return id;
 	}
+#endif
 }
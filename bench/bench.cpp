@@ -0,0 +1,659 @@
+/*
+	Micro benchmarks for Lua.hpp. Every wrapper case has a raw_ twin doing the same
+	work through the C API, so the difference is the cost of the wrapper itself.
+
+	Cases run on a default state. heap/op counts calls to the global operator new,
+	which catches what the wrapper allocates itself (stateless strings,
+	std::function, containers). The counted/ copy of a case runs it on a state
+	created with an allocator and adds allocs/op, the Lua allocations of one
+	iteration. 64-bit LuaJIT without GC64 refuses custom allocators, so counted/
+	cases are skipped there.
+
+	invoke_ cases go through operator() and so measure the return option the
+	binary was built with, see CMakeLists.txt.
+*/
+
+#include "Lua.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+namespace
+{
+	std::atomic<size_t> heapAllocations(0);
+}
+
+void* operator new(size_t size)
+{
+	heapAllocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(size != 0 ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+//the replacement new is malloc based, so free is the matching release
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	std::free(p);
+}
+
+namespace
+{
+	void* lua_heap(void *, void *ptr, size_t, size_t nsize)
+	{
+		if (nsize == 0)
+		{
+			std::free(ptr);
+			return nullptr;
+		}
+		return std::realloc(ptr, nsize);
+	}
+
+	const char *const long_text = "a string well past the small string capacity of a local";
+	const size_t long_length = std::strlen(long_text);
+	int address;
+
+	//DoNotOptimize wants an lvalue
+	template<typename T>
+	void keep(T v)
+	{
+		benchmark::DoNotOptimize(v);
+	}
+
+	void prepare(lua::state &s)
+	{
+		s.open_libs();
+		s.do_string(
+			"function f0() end "
+			"function f1(x) return x end "
+			"function f4(x) return x, x, x, x end "
+			"items = {} for i = 1, 100 do items[i] = i end "
+			"items.name = 'value'");
+
+		lua_State *L = s;
+		lua_newuserdata(L, 16);
+		lua_setglobal(L, "ud");
+		lua_newthread(L);
+		lua_setglobal(L, "co");
+	}
+
+	template<typename Op>
+	void measure(benchmark::State &st, lua::state *counted, Op &op)
+	{
+		size_t lua0 = counted != nullptr ? counted->allocation_count() : 0;
+		size_t heap0 = heapAllocations.load(std::memory_order_relaxed);
+
+		for (auto _ : st)
+			op();
+
+		if (counted != nullptr)
+			st.counters["allocs/op"] = benchmark::Counter(static_cast<double>(counted->allocation_count() - lua0), benchmark::Counter::kAvgIterations);
+		st.counters["heap/op"] = benchmark::Counter(static_cast<double>(heapAllocations.load(std::memory_order_relaxed) - heap0), benchmark::Counter::kAvgIterations);
+	}
+
+	//make is called with a prepared state and returns the operation to time, which dies before the state
+	template<typename Make>
+	void add(const std::string &name, Make make)
+	{
+		benchmark::RegisterBenchmark(name.c_str(), [make](benchmark::State &st)
+		{
+			lua::state s;
+			prepare(s);
+			auto op = make(s);
+			measure(st, nullptr, op);
+		});
+
+		benchmark::RegisterBenchmark(("counted/" + name).c_str(), [make](benchmark::State &st)
+		{
+			std::unique_ptr<lua::state> s;
+			try
+			{
+				s.reset(new lua::state(lua_heap, nullptr));
+			}
+			catch (const std::exception &e)
+			{
+				st.SkipWithError(e.what());
+				return;
+			}
+			prepare(*s);
+			auto op = make(*s);
+			measure(st, s.get(), op);
+		});
+	}
+
+	//the wrapper throws on Lua errors, the raw cases do the same so a failure is not timed as a success
+	void raw_check(lua_State *L, int status)
+	{
+		if (status != 0)
+		{
+			std::string message = lua_tostring(L, -1);
+			lua_pop(L, 1);
+			throw std::runtime_error(message);
+		}
+	}
+
+	enum class kind
+	{
+		nil,
+		boolean,
+		number,
+		integer,
+		string,
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		small_string,
+		stateless_string,
+#endif
+		table,
+		function,
+		cfunction,
+		userdata,
+		lightuserdata,
+		thread,
+	};
+
+	struct named_kind
+	{
+		const char *name;
+		kind k;
+	};
+
+	const named_kind kinds[] =
+	{
+		{ "nil", kind::nil },
+		{ "boolean", kind::boolean },
+		{ "number", kind::number },
+		{ "integer", kind::integer },
+		{ "string", kind::string },
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		{ "small_string", kind::small_string },
+		{ "stateless_string", kind::stateless_string },
+#endif
+		{ "table", kind::table },
+		{ "function", kind::function },
+		{ "cfunction", kind::cfunction },
+		{ "userdata", kind::userdata },
+		{ "lightuserdata", kind::lightuserdata },
+		{ "thread", kind::thread },
+	};
+
+	int noop(lua_State *)
+	{
+		return 0;
+	}
+
+	lua::local make_value(lua::state &s, kind k)
+	{
+		switch (k)
+		{
+		case kind::nil:              return lua::local(s);
+		case kind::boolean:          return lua::local(s, true);
+		case kind::number:           return lua::local(s, 0.5);
+		case kind::integer:          { lua::local v(s); v.set_as_integer(42); return v; }
+		case kind::string:           return lua::local(s, long_text);
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		case kind::small_string:     return lua::local("key");
+		case kind::stateless_string: return lua::local(long_text);
+#endif
+		case kind::table:            return s.create_table();
+		case kind::function:         return s.get_global("f0");
+		case kind::cfunction:        return lua::local(s, &noop);
+		case kind::userdata:         return s.get_global("ud");
+		case kind::lightuserdata:    return lua::local(s, static_cast<void*>(&address));
+		case kind::thread:           return s.get_global("co");
+		}
+		return lua::local(s);
+	}
+
+	//what the wrapper does for k, straight through the C API
+	void raw_push(lua_State *L, kind k, int ref)
+	{
+		switch (k)
+		{
+		case kind::nil:              lua_pushnil(L);                                break;
+		case kind::boolean:          lua_pushboolean(L, 1);                         break;
+		case kind::number:           lua_pushnumber(L, 0.5);                        break;
+		case kind::integer:          lua_pushinteger(L, 42);                        break;
+#ifdef LUA_WRAPPER_STATELESS_STRINGS
+		case kind::small_string:     lua_pushlstring(L, "key", 3);                  break;
+		case kind::stateless_string: lua_pushlstring(L, long_text, long_length);    break;
+#endif
+		case kind::cfunction:        lua_pushcfunction(L, &noop);                   break;
+		case kind::lightuserdata:    lua_pushlightuserdata(L, &address);            break;
+		default:                     lua_rawgeti(L, LUA_REGISTRYINDEX, ref);        break;
+		}
+	}
+
+	//loading these takes a reference, strings included since Lua hands back no stateless ones
+	bool is_reference(lua_State *L, int idx)
+	{
+		switch (lua_type(L, idx))
+		{
+		case LUA_TSTRING:
+		case LUA_TTABLE:
+		case LUA_TUSERDATA:
+		case LUA_TTHREAD:
+			return true;
+		case LUA_TFUNCTION:
+			return !lua_iscfunction(L, idx);
+		default:
+			return false;
+		}
+	}
+
+	/* push and load */
+
+	auto push(kind k)
+	{
+		return [k](lua::state &s)
+		{
+			return [L = static_cast<lua_State*>(s), v = make_value(s, k)]
+			{
+				lua::push_traits<lua::local>::push(L, v);
+				lua_pop(L, 1);
+			};
+		};
+	}
+
+	auto raw_push(kind k)
+	{
+		return [k](lua::state &s)
+		{
+			lua_State *L = s;
+			lua::push_traits<lua::local>::push(L, make_value(s, k));
+			int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			return [L, k, ref]
+			{
+				raw_push(L, k, ref);
+				lua_pop(L, 1);
+			};
+		};
+	}
+
+	auto load(kind k)
+	{
+		return [k](lua::state &s)
+		{
+			s.set_global(make_value(s, k), "value");
+			return [&s, name = s.intern("value"), v = lua::local()]() mutable
+			{
+				v = s.get_global(name);
+				keep(&v);
+			};
+		};
+	}
+
+	auto raw_load(kind k)
+	{
+		return [k](lua::state &s)
+		{
+			s.set_global(make_value(s, k), "value");
+			return [L = static_cast<lua_State*>(s), ref = LUA_NOREF]() mutable
+			{
+				lua_getglobal(L, "value");
+				if (is_reference(L, -1))
+				{
+					//a loaded reference type replaces the one it overwrites, as v = ... does
+					luaL_unref(L, LUA_REGISTRYINDEX, ref);
+					ref = luaL_ref(L, LUA_REGISTRYINDEX);
+				}
+				else
+				{
+					keep(lua_tonumber(L, -1));
+					lua_pop(L, 1);
+				}
+			};
+		};
+	}
+
+	/* copy and move */
+
+	auto copy(kind k)
+	{
+		return [k](lua::state &s)
+		{
+			return [a = make_value(s, k)]
+			{
+				lua::local b(a);
+				keep(&b);
+			};
+		};
+	}
+
+	auto move(kind k)
+	{
+		return [k](lua::state &s)
+		{
+			return [a = make_value(s, k)]() mutable
+			{
+				//there and back, so a holds the value for the next iteration
+				lua::local b(std::move(a));
+				a = std::move(b);
+				keep(&a);
+			};
+		};
+	}
+
+	/* table access */
+
+	auto table_get_integer(lua::state &s)
+	{
+		return [t = s.get_global("items"), i = lua_Integer(0)]() mutable
+		{
+			lua::local v = t.table_get(i++ % 100 + 1);
+			keep(&v);
+		};
+	}
+
+	auto table_get_string(lua::state &s)
+	{
+		return [t = s.get_global("items"), key = lua::local(s, "name")]() mutable
+		{
+			lua::local v = t.table_get(key);
+			keep(&v);
+		};
+	}
+
+	auto table_get_interned(lua::state &s)
+	{
+		return [t = s.get_global("items"), key = s.intern("name")]() mutable
+		{
+			lua::local v = t.table_get(key);
+			keep(&v);
+		};
+	}
+
+	auto raw_table_get_integer(lua::state &s)
+	{
+		lua_State *L = s;
+		lua_getglobal(L, "items");
+		return [L, i = 0]() mutable
+		{
+			lua_pushinteger(L, i++ % 100 + 1);
+			lua_gettable(L, -2);
+			keep(lua_tonumber(L, -1));
+			lua_pop(L, 1);
+		};
+	}
+
+	auto raw_table_get_string(lua::state &s)
+	{
+		lua_State *L = s;
+		lua_getglobal(L, "items");
+		return [L]
+		{
+			lua_getfield(L, -1, "name");
+			keep(lua_tostring(L, -1));
+			lua_pop(L, 1);
+		};
+	}
+
+	auto table_set_integer(lua::state &s)
+	{
+		return [t = s.get_global("items"), v = make_value(s, kind::number), i = lua_Integer(0)]() mutable
+		{
+			t.table_set(i++ % 100 + 1, v);
+		};
+	}
+
+	auto table_set_string(lua::state &s)
+	{
+		return [t = s.get_global("items"), key = lua::local(s, "name"), v = make_value(s, kind::number)]() mutable
+		{
+			t.table_set(key, v);
+		};
+	}
+
+	auto table_set_interned(lua::state &s)
+	{
+		return [t = s.get_global("items"), key = s.intern("name"), v = make_value(s, kind::number)]() mutable
+		{
+			t.table_set(key, v);
+		};
+	}
+
+	auto raw_table_set_integer(lua::state &s)
+	{
+		lua_State *L = s;
+		lua_getglobal(L, "items");
+		return [L, i = 0]() mutable
+		{
+			lua_pushinteger(L, i++ % 100 + 1);
+			lua_pushnumber(L, 0.5);
+			lua_settable(L, -3);
+		};
+	}
+
+	auto raw_table_set_string(lua::state &s)
+	{
+		lua_State *L = s;
+		lua_getglobal(L, "items");
+		return [L]
+		{
+			lua_pushnumber(L, 0.5);
+			lua_setfield(L, -2, "name");
+		};
+	}
+
+	/* table_index proxies */
+
+	auto proxy_get_integer(lua::state &s)
+	{
+		return [t = s.get_global("items"), i = lua_Integer(0)]() mutable
+		{
+			lua::local v = t[i++ % 100 + 1];
+			keep(&v);
+		};
+	}
+
+	auto proxy_get_interned(lua::state &s)
+	{
+		return [t = s.get_global("items"), key = s.intern("name")]() mutable
+		{
+			lua::local v = t[key];
+			keep(&v);
+		};
+	}
+
+	auto proxy_set_integer(lua::state &s)
+	{
+		return [t = s.get_global("items"), v = make_value(s, kind::number), i = lua_Integer(0)]() mutable
+		{
+			t[i++ % 100 + 1] = v;
+		};
+	}
+
+	auto proxy_set_interned(lua::state &s)
+	{
+		return [t = s.get_global("items"), key = s.intern("name"), v = make_value(s, kind::number)]() mutable
+		{
+			t[key] = v;
+		};
+	}
+
+	/* calls */
+
+	auto call_0(lua::state &s)
+	{
+		return [fn = s.get_global("f0")]() mutable
+		{
+			fn.call<>();
+		};
+	}
+
+	auto call_1(lua::state &s)
+	{
+		return [fn = s.get_global("f1")]() mutable
+		{
+			keep(std::get<0>(fn.call<lua_Number>(0.5)));
+		};
+	}
+
+	auto call_4(lua::state &s)
+	{
+		return [fn = s.get_global("f4")]() mutable
+		{
+			auto r = fn.call<lua_Number, lua_Number, lua_Number, lua_Number>(0.5);
+			keep(&r);
+		};
+	}
+
+	//a local, a table of the results or a vector, depending on the return option
+	auto invoke_0(lua::state &s)
+	{
+		return [fn = s.get_global("f0")]() mutable
+		{
+			auto r = fn();
+			keep(&r);
+		};
+	}
+
+	auto invoke_1(lua::state &s)
+	{
+		return [fn = s.get_global("f1")]() mutable
+		{
+			auto r = fn(0.5);
+			keep(&r);
+		};
+	}
+
+#ifndef LUA_WRAPPER_SINGLE_RETURN
+	auto invoke_4(lua::state &s)
+	{
+		return [fn = s.get_global("f4")]() mutable
+		{
+			auto r = fn(0.5);
+			keep(&r);
+		};
+	}
+#endif
+
+	auto raw_call(const char *name, int nresults)
+	{
+		return [name, nresults](lua::state &s)
+		{
+			lua_State *L = s;
+			lua_getglobal(L, name);
+			int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+			return [L, ref, nresults]
+			{
+				lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+				lua_pushnumber(L, 0.5);
+				raw_check(L, lua_pcall(L, 1, nresults, 0));
+				for (int i = 1; i <= nresults; i++)
+					keep(lua_tonumber(L, -i));
+				lua_pop(L, nresults);
+			};
+		};
+	}
+
+	/* chunks */
+
+	const char *const chunk = "local x = 0 for i = 1, 10 do x = x + i end return x";
+
+	auto do_string(lua::state &s)
+	{
+		return [&s]
+		{
+			s.do_string(chunk);
+		};
+	}
+
+	auto cached_chunk(lua::state &s)
+	{
+		return [fn = s.load_string(chunk)]() mutable
+		{
+			fn.call<>();
+		};
+	}
+
+	auto raw_do_string(lua::state &s)
+	{
+		return [L = static_cast<lua_State*>(s)]
+		{
+			raw_check(L, luaL_loadstring(L, chunk));
+			raw_check(L, lua_pcall(L, 0, 0, 0));
+		};
+	}
+
+	auto raw_cached_chunk(lua::state &s)
+	{
+		lua_State *L = s;
+		raw_check(L, luaL_loadstring(L, chunk));
+		int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+		return [L, ref]
+		{
+			lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+			raw_check(L, lua_pcall(L, 0, 0, 0));
+		};
+	}
+}
+
+int main(int argc, char **argv)
+{
+	for (const named_kind &k : kinds)
+	{
+		const std::string name = k.name;
+		add("push/" + name, push(k.k));
+		add("raw_push/" + name, raw_push(k.k));
+		add("load/" + name, load(k.k));
+		add("raw_load/" + name, raw_load(k.k));
+		add("copy/" + name, copy(k.k));
+		add("move/" + name, move(k.k));
+	}
+
+	add("table_get_integer", table_get_integer);
+	add("table_get_string", table_get_string);
+	add("table_get_interned", table_get_interned);
+	add("raw_table_get_integer", raw_table_get_integer);
+	add("raw_table_get_string", raw_table_get_string);
+	add("table_set_integer", table_set_integer);
+	add("table_set_string", table_set_string);
+	add("table_set_interned", table_set_interned);
+	add("raw_table_set_integer", raw_table_set_integer);
+	add("raw_table_set_string", raw_table_set_string);
+
+	add("proxy_get_integer", proxy_get_integer);
+	add("proxy_get_interned", proxy_get_interned);
+	add("proxy_set_integer", proxy_set_integer);
+	add("proxy_set_interned", proxy_set_interned);
+
+	add("call_0", call_0);
+	add("call_1", call_1);
+	add("call_4", call_4);
+	add("invoke_0", invoke_0);
+	add("invoke_1", invoke_1);
+#ifndef LUA_WRAPPER_SINGLE_RETURN
+	add("invoke_4", invoke_4);
+#endif
+	add("raw_call_0", raw_call("f0", 0));
+	add("raw_call_1", raw_call("f1", 1));
+	add("raw_call_4", raw_call("f4", 4));
+
+	add("do_string", do_string);
+	add("cached_chunk", cached_chunk);
+	add("raw_do_string", raw_do_string);
+	add("raw_cached_chunk", raw_cached_chunk);
+
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	return 0;
+}
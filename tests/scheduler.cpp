@@ -0,0 +1,69 @@
+#include "Lua.hpp"
+
+#include <cstdio>
+#include <future>
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool ok, const char *what)
+	{
+		if (!ok)
+		{
+			std::fprintf(stderr, "FAILED: %s\n", what);
+			++failures;
+		}
+	}
+
+	//a table resolved into a coroutine lives in the registry and has to cross over to the coroutine's stack
+	void future_local_resumes_coroutine()
+	{
+		lua::state s;
+		s.open_libs();
+		lua::scheduler sc(s);
+
+		std::promise<lua::local> promise;
+		s.set_global(lua::bind(s, [&promise] { return promise.get_future(); }), "fetch");
+		s.do_string("function job() local t, err = fetch() result = t and t.x or err end");
+
+		sc.spawn(s.get_global("job"));
+		sc.poll();
+		check(sc.pending() == 1, "coroutine waits on the future");
+
+		lua::local t = s.create_table();
+		t.table_set(lua::local(s, "x"), lua::local(s, 42.0));
+		promise.set_value(t);
+		sc.run();
+
+		lua::local result = s.get_global("result");
+		check(result.is_number() && result.to_number() == 42, "future<local> resumes the coroutine with the table");
+	}
+
+	void returned_local_inside_coroutine()
+	{
+		lua::state s;
+		s.open_libs();
+		lua::scheduler sc(s);
+
+		s.set_global(lua::bind(s, [&s] {
+			lua::local t = s.create_table();
+			t.table_set(1, lua::local(s, 7.0));
+			return t;
+		}), "make");
+		s.do_string("function job() result = make()[1] end");
+
+		sc.spawn(s.get_global("job"));
+		sc.run();
+
+		lua::local result = s.get_global("result");
+		check(result.is_number() && result.to_number() == 7, "returned local is pushed onto the coroutine");
+	}
+}
+
+int main()
+{
+	future_local_resumes_coroutine();
+	returned_local_inside_coroutine();
+	return failures == 0 ? 0 : 1;
+}